@@ -0,0 +1,294 @@
+#!/bin/sh
+# Benchmarks de la minishell, compila myshell y saca un CSV: metrica,valor,unidad,base,cambio,estado
+# base es el valor de bench/baseline.csv, cambio el porcentaje respecto a él (positivo es mejor)
+# y estado "peor" si empeora más de un 20 %, para que se vea en la revisión.
+# Uso: bench/bench.sh [-r] [-g]   -r: versión rápida (menos repeticiones)   -g: guardar el resultado como nueva base
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+BASE="$DIR/bench/baseline.csv"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+RAPIDO=0
+GUARDAR=0
+for arg in "$@"; do
+    case $arg in
+        -r) RAPIDO=1 ;;
+        -g) GUARDAR=1 ;;
+        *) echo "Uso: $0 [-r] [-g]" >&2; exit 2 ;;
+    esac
+done
+if [ $RAPIDO -eq 1 ]; then
+    N_LANZAR=1000; N_LINEAS=2000; MB_PIPE=16; MB_CAPTURA=32; N_SOAK=10000; N_GLOB=20000; N_HISTORIA=200000; N_JOBS="1000"; VUELTAS_PARSER=1
+else
+    N_LANZAR=5000; N_LINEAS=10000; MB_PIPE=64; MB_CAPTURA=300; N_SOAK=100000; N_GLOB=100000; N_HISTORIA=1000000; N_JOBS="1000 5000 10000"; VUELTAS_PARSER=5
+fi
+
+gcc -O2 -Wall -Wextra "$DIR/myshell.c" "$DIR/parser.c" -o "$TMP/myshell" -static || exit 1
+MS="$TMP/myshell"
+export TERM=dumb
+export HOME="$TMP"  # Las pruebas en modo interactivo guardan su historia aquí, no en la del usuario
+
+ahora() { date +%s%N; }
+
+# metrica valor unidad mayor|menor (qué es mejor)
+RESULTADOS="$TMP/resultados.csv"
+: > "$RESULTADOS"
+anotar() { echo "$1,$2,$3,$4" >> "$RESULTADOS"; }
+
+# Repetir una línea N veces en un fichero
+repetir() {
+    i=0
+    while [ $i -lt "$2" ]; do
+        echo "$1"
+        i=$((i + 1))
+    done > "$3"
+}
+
+# Creación de procesos de ejecutar_externo() con cada forma de lanzar
+repetir /bin/true "$N_LANZAR" "$TMP/lanzar"
+for modo in fork posix_spawn; do
+    t0=$(ahora)
+    MYSHELL_SPAWN=$modo "$MS" "$TMP/lanzar" > /dev/null 2>&1
+    ns=$(($(ahora) - t0))
+    anotar "lanzamiento_$modo" $((N_LANZAR * 1000000000 / ns)) mandatos/s mayor
+done
+
+# Caudal por pipelines de 1 a 16 etapas de ejecutar_pipe()
+BYTES=$((MB_PIPE * 1048576))
+for etapas in 1 2 4 8 16; do
+    linea="head -c $BYTES /dev/zero"
+    i=0
+    while [ $i -lt $etapas ]; do
+        linea="$linea | cat"
+        i=$((i + 1))
+    done
+    t0=$(ahora)
+    "$MS" -c "$linea > /dev/null"
+    ns=$(($(ahora) - t0))
+    anotar "pipeline_$etapas" $((BYTES * 1000 / ns)) MB/s mayor
+done
+
+# El de 8 etapas con cada política de sched, con una sola CPU no hay diferencia
+for plan in pack spread; do
+    linea="head -c $BYTES /dev/zero"
+    i=0
+    while [ $i -lt 8 ]; do
+        linea="$linea | cat"
+        i=$((i + 1))
+    done
+    t0=$(ahora)
+    "$MS" -c "sched --$plan
+$linea > /dev/null"
+    ns=$(($(ahora) - t0))
+    anotar "pipeline_8_$plan" $((BYTES * 1000 / ns)) MB/s mayor
+done
+
+# Latencia de prompt a prompt, con el modo interactivo forzado, para un mandato interno y uno externo
+repetir "umask 022" "$N_LINEAS" "$TMP/interno"
+repetir "/bin/true" "$N_LANZAR" "$TMP/externo"
+t0=$(ahora)
+"$MS" -i < "$TMP/interno" > /dev/null 2>&1
+anotar prompt_interno $((($(ahora) - t0) / N_LINEAS)) ns menor
+t0=$(ahora)
+"$MS" -i < "$TMP/externo" > /dev/null 2>&1
+anotar prompt_externo $((($(ahora) - t0) / N_LANZAR)) ns menor
+# Lo mismo con la traza activada, lo que cuesta registrar la línea, el fork, el exec y el exit
+t0=$(ahora)
+MYSHELL_TRACE="$TMP/traza" "$MS" -i < "$TMP/externo" > /dev/null 2>&1
+anotar prompt_externo_traza $((($(ahora) - t0) / N_LANZAR)) ns menor
+
+# Líneas por segundo de un script sin prompt
+t0=$(ahora)
+"$MS" "$TMP/interno" > /dev/null 2>&1
+anotar script_interno $((N_LINEAS * 1000000000 / ($(ahora) - t0))) lineas/s mayor
+
+# Mandatos internos sin crear procesos, sueltos y en un pipeline
+repetir "echo x" "$N_LINEAS" "$TMP/echo"
+t0=$(ahora)
+"$MS" "$TMP/echo" > /dev/null 2>&1
+anotar script_echo $((N_LINEAS * 1000000000 / ($(ahora) - t0))) lineas/s mayor
+repetir "true | false | true" "$N_LINEAS" "$TMP/puros"
+t0=$(ahora)
+"$MS" "$TMP/puros" > /dev/null 2>&1
+anotar script_pipeline_interno $((N_LINEAS * 1000000000 / ($(ahora) - t0))) lineas/s mayor
+
+# Sustitución de mandatos de MB_CAPTURA MB: la captura en un solo argumento, partida en argumentos de 16 bytes,
+# y pasada a wc por un here-string (memfd)
+BYTES=$((MB_CAPTURA * 1048576))
+t0=$(ahora)
+"$MS" -c "true \$(head -c $BYTES /dev/zero | tr \\0 x)"
+anotar captura $((BYTES * 1000 / ($(ahora) - t0))) MB/s mayor
+t0=$(ahora)
+"$MS" -c "true \$(yes 0123456789abcdef | head -c $BYTES)"
+anotar captura_campos $((BYTES * 1000 / ($(ahora) - t0))) MB/s mayor
+t0=$(ahora)
+"$MS" -c "wc -c <<< \$(head -c $BYTES /dev/zero | tr \\0 x)" > /dev/null
+anotar captura_here_string $((BYTES * 1000 / ($(ahora) - t0))) MB/s mayor
+
+# Soak de redirecciones: N_SOAK líneas con redirecciones de todo tipo (internos, y cada 10 un externo o un pipeline)
+# y los descriptores abiertos en la minishell al principio y al final, que tienen que ser los mismos
+echo 'ls /proc/$PPID/fd | wc -l' > "$TMP/fds.sh"
+awk -v n="$N_SOAK" -v d="$TMP" 'BEGIN {
+    print "/bin/sh " d "/fds.sh > " d "/fds_inicio"
+    for (i = 0; i < n; i++) {
+        if (i % 20 == 0) print "/bin/cat " d "/s1 2>&1 | /bin/cat >> " d "/s2 2> " d "/s3"
+        else if (i % 20 == 10) print "/bin/true < " d "/s1 &> " d "/s4"
+        else if (i % 4 == 0) print "echo " i " > " d "/s1"
+        else if (i % 4 == 1) print "echo " i " >> " d "/s1 2>> " d "/s3"
+        else if (i % 4 == 2) print "true <<< " i
+        else print "test -f " d "/s1 < " d "/s1 > " d "/s4 2>&1"
+    }
+    print "/bin/sh " d "/fds.sh > " d "/fds_fin"
+}' > "$TMP/soak"
+t0=$(ahora)
+"$MS" "$TMP/soak" > /dev/null 2>&1
+anotar soak_redirecciones $((N_SOAK * 1000000000 / ($(ahora) - t0))) lineas/s mayor
+anotar soak_fds_perdidos $(($(cat "$TMP/fds_fin") - $(cat "$TMP/fds_inicio"))) fds menor
+
+# Comodines en un directorio de N_GLOB ficheros: la primera expansión de una minishell nueva (lee el directorio, menos lo
+# que tarda en arrancar y ejecutar una línea sin comodines) y las siguientes con el listado en caché, con un principio
+# fijo (búsqueda binaria) y sin él (fnmatch con todas las entradas)
+mkdir "$TMP/glob"
+(cd "$TMP/glob" && seq -f 'f%g.log' "$N_GLOB" | xargs touch)
+sleep 0.2  # Que el mtime del directorio quede lo bastante atrás para fiarse del listado
+echo "echo $TMP/glob/f1234*.log" > "$TMP/glob_uno"
+echo "echo $TMP/glob/f1234.log" > "$TMP/glob_nada"
+t_uno=0; t_nada=0
+for i in 1 2 3 4 5; do
+    t0=$(ahora); "$MS" "$TMP/glob_uno" > /dev/null; t_uno=$((t_uno + $(ahora) - t0))
+    t0=$(ahora); "$MS" "$TMP/glob_nada" > /dev/null; t_nada=$((t_nada + $(ahora) - t0))
+done
+anotar glob_frio $(((t_uno - t_nada) / 5000)) us menor
+repetir "echo $TMP/glob/f1234*.log" 1000 "$TMP/glob_prefijo"
+repetir "echo $TMP/glob/f1234.log" 1000 "$TMP/glob_nada"
+t0=$(ahora); "$MS" "$TMP/glob_nada" > /dev/null; t_nada=$(($(ahora) - t0))
+t0=$(ahora); "$MS" "$TMP/glob_prefijo" > /dev/null; t_uno=$(($(ahora) - t0))
+anotar glob_caliente_prefijo $(((t_uno - t_nada) / 1000)) ns menor
+repetir "echo $TMP/glob/*1234.log" 100 "$TMP/glob_todo"
+t0=$(ahora); "$MS" "$TMP/glob_todo" > /dev/null; t_uno=$(($(ahora) - t0))
+anotar glob_caliente $((t_uno / 100000)) us menor
+# ** al final del patrón en un árbol de 100 directorios con 100 ficheros cada uno, con el listado en caché, y cuántos
+# caminos difieren de lo esperado (el propio directorio con su /, como bash con globstar, y todo lo de debajo): debe ser 0
+mkdir "$TMP/arbol"
+(cd "$TMP/arbol" && for d in $(seq 100); do mkdir "d$d" && (cd "d$d" && seq -f 'f%g' 100 | xargs touch); done)
+sleep 0.2
+echo "echo $TMP/arbol/**" | "$MS" | tr ' ' '\n' | LC_ALL=C sort > "$TMP/globstar"
+{ echo "$TMP/arbol/"; find "$TMP/arbol" -mindepth 1; } | LC_ALL=C sort > "$TMP/globstar_esperado"
+repetir "echo $TMP/arbol/**" 100 "$TMP/globstar_todo"
+t0=$(ahora); "$MS" "$TMP/globstar_todo" > /dev/null; t_uno=$(($(ahora) - t0))
+anotar glob_globstar $((t_uno / 100000)) us menor
+anotar glob_globstar_distintos "$(LC_ALL=C comm -3 "$TMP/globstar" "$TMP/globstar_esperado" | wc -l)" caminos menor
+
+# Historia de N_HISTORIA entradas (en un HOME propio): arranque en modo interactivo con ella y sin ella (solo se proyecta, no
+# se lee), la primera búsqueda por prefijo de una sesión (indexa y ordena todo) y las siguientes, y la búsqueda de un texto
+mkdir "$TMP/historia" "$TMP/sin_historia"
+seq -f 'mandato%.0f --opcion' "$N_HISTORIA" > "$TMP/historia/.myshell_history"
+echo true > "$TMP/hist_true"
+t_vacia=0; t_llena=0
+for i in 1 2 3 4 5; do
+    t0=$(ahora); HOME="$TMP/sin_historia" "$MS" -i "$TMP/hist_true" > /dev/null; t_vacia=$((t_vacia + $(ahora) - t0))
+    t0=$(ahora); HOME="$TMP/historia" "$MS" -i "$TMP/hist_true" > /dev/null; t_llena=$((t_llena + $(ahora) - t0))
+done
+anotar arranque_sin_historia $((t_vacia / 5000)) us menor
+anotar arranque_historia $((t_llena / 5000)) us menor
+echo "history -p mandato4242" > "$TMP/hist_primera"
+t0=$(ahora); HOME="$TMP/historia" "$MS" -i "$TMP/hist_primera" > /dev/null; t_primera=$(($(ahora) - t0))
+anotar historia_indice $(((t_primera - t_llena / 5) / 1000)) us menor
+repetir "history -p mandato4242" 101 "$TMP/hist_prefijo"
+t0=$(ahora); HOME="$TMP/historia" "$MS" -i "$TMP/hist_prefijo" > /dev/null
+anotar historia_prefijo $((($(ahora) - t0 - t_primera) / 100000)) us menor
+repetir "history -s ato42424" 20 "$TMP/hist_texto"
+cat "$TMP/hist_primera" "$TMP/hist_texto" > "$TMP/hist_texto_primera"
+t0=$(ahora); HOME="$TMP/historia" "$MS" -i "$TMP/hist_texto_primera" > /dev/null
+anotar historia_texto $((($(ahora) - t0 - t_primera) / 20000)) us menor
+
+# Variables: lo que cuesta expandir $VAR, ${VAR} y $? en una línea (contra la misma línea ya expandida), y los lanzamientos
+# con 500 variables exportadas, con el envp construido una vez, y con una asignación delante de cada mandato, que necesita
+# un envp nuevo por lanzamiento
+{ echo "A=uno"; echo "B=dos"; } > "$TMP/variables"
+cp "$TMP/variables" "$TMP/sin_variables"
+repetir 'echo $A ${B}x $? $A$B' "$N_LINEAS" "$TMP/lineas_variables"
+repetir 'echo uno dosx 0 unodos' "$N_LINEAS" "$TMP/lineas_sin_variables"
+cat "$TMP/lineas_variables" >> "$TMP/variables"
+cat "$TMP/lineas_sin_variables" >> "$TMP/sin_variables"
+t0=$(ahora); "$MS" "$TMP/sin_variables" > /dev/null; t_sin=$(($(ahora) - t0))
+t0=$(ahora); "$MS" "$TMP/variables" > /dev/null; t_con=$(($(ahora) - t0))
+anotar expansion_variables $(((t_con - t_sin) / N_LINEAS)) ns/linea menor
+seq -f 'export VARIABLE%.0f=valor_de_la_variable_%.0f' 500 > "$TMP/entorno"
+cp "$TMP/entorno" "$TMP/entorno_prefijo"
+repetir /bin/true "$N_LANZAR" "$TMP/lanzar_entorno"
+repetir "A=1 /bin/true" "$N_LANZAR" "$TMP/lanzar_prefijo"
+cat "$TMP/lanzar_entorno" >> "$TMP/entorno"
+cat "$TMP/lanzar_prefijo" >> "$TMP/entorno_prefijo"
+t0=$(ahora); "$MS" "$TMP/entorno" > /dev/null 2>&1
+anotar lanzamiento_entorno $((N_LANZAR * 1000000000 / ($(ahora) - t0))) mandatos/s mayor
+t0=$(ahora); "$MS" "$TMP/entorno_prefijo" > /dev/null 2>&1
+anotar lanzamiento_prefijo $((N_LANZAR * 1000000000 / ($(ahora) - t0))) mandatos/s mayor
+
+# Tiempo de parseo por línea
+"$DIR/bench/parser.sh" "$VUELTAS_PARSER" > "$TMP/parser" 2>&1
+anotar parse_tokenize_r "$(sed -n 's/^tokenize_r: \([0-9]*\) ns.*/\1/p' "$TMP/parser")" ns/linea menor
+anotar parse_libparser "$(sed -n 's/^libparser.a: \([0-9]*\) ns.*/\1/p' "$TMP/parser")" ns/linea menor
+
+# Coste de la tabla de jobs: lanzar y recoger N jobs en background y listarlos
+for n in $N_JOBS; do
+    repetir "/bin/true &" "$n" "$TMP/jobs"
+    echo "jobs" >> "$TMP/jobs"
+    t0=$(ahora)
+    "$MS" "$TMP/jobs" > /dev/null 2>&1
+    anotar "jobs_$n" $((($(ahora) - t0) / n)) ns/job menor
+done
+
+# Modo servidor: latencia por petición de un cliente contra la de arrancar una minishell por mandato
+# (sin terminal con -c, y en modo interactivo con clear y banner), y clientes/s con 4 clientes a la vez.
+# Lanzando cliente desde sh por cada petición se paga su exec, que cuesta lo mismo que el de la minishell: así solo
+# se gana frente al arranque interactivo. servidor_llamador y proceso_llamador son lo mismo desde un proceso que ya
+# está en marcha (bench/servidor.c), que es para lo que está el modo: ahí solo queda el fork de la sesión
+gcc -O2 -Wall -Wextra "$DIR/cliente.c" -o "$TMP/cliente" -static || exit 1
+gcc -O2 -Wall -Wextra "$DIR/bench/servidor.c" -o "$TMP/servidor" || exit 1
+"$MS" --serve "$TMP/sock" 2> /dev/null &
+SERVIDOR=$!
+while [ ! -S "$TMP/sock" ]; do sleep 0.01; done
+t0=$(ahora)
+i=0
+while [ $i -lt "$N_LANZAR" ]; do "$TMP/cliente" "$TMP/sock" true; i=$((i + 1)); done
+anotar servidor_peticion $((($(ahora) - t0) / N_LANZAR)) ns menor
+t0=$(ahora)
+i=0
+while [ $i -lt "$N_LANZAR" ]; do "$MS" -c true; i=$((i + 1)); done
+anotar proceso_peticion $((($(ahora) - t0) / N_LANZAR)) ns menor
+t0=$(ahora)
+i=0
+while [ $i -lt "$N_LANZAR" ]; do "$MS" -i -c true > /dev/null 2>&1; i=$((i + 1)); done
+anotar proceso_peticion_interactivo $((($(ahora) - t0) / N_LANZAR)) ns menor
+t0=$(ahora)
+clientes=""
+for c in 1 2 3 4; do
+    (i=0; while [ $i -lt $((N_LANZAR / 4)) ]; do "$TMP/cliente" "$TMP/sock" true; i=$((i + 1)); done) &
+    clientes="$clientes $!"
+done
+wait $clientes
+anotar servidor_clientes $((N_LANZAR / 4 * 4 * 1000000000 / ($(ahora) - t0))) clientes/s mayor
+"$TMP/servidor" "$TMP/sock" "$MS" "$N_LANZAR" true > "$TMP/llamador"
+anotar servidor_llamador "$(awk '$1 == "servidor" { print $2 }' "$TMP/llamador")" ns menor
+anotar proceso_llamador "$(awk '$1 == "proceso" { print $2 }' "$TMP/llamador")" ns menor
+kill $SERVIDOR
+
+# Comparar con la base
+echo "metrica,valor,unidad,base,cambio,estado"
+awk -F, -v base="$BASE" '
+    BEGIN { while ((getline l < base) > 0) { split(l, c, ","); if (c[1] != "metrica") b[c[1]] = c[2] } }
+    {
+        v = $2; cambio = ""; estado = "nuevo"
+        if (($1 in b) && b[$1] > 0 && v != "") {
+            cambio = ($4 == "mayor") ? (v - b[$1]) * 100 / b[$1] : (b[$1] - v) * 100 / b[$1]
+            estado = cambio < -20 ? "peor" : "ok"
+            cambio = sprintf("%+.1f%%", cambio)
+        }
+        printf "%s,%s,%s,%s,%s,%s\n", $1, v, $3, ($1 in b) ? b[$1] : "", cambio, estado
+    }' "$RESULTADOS"
+
+if [ $GUARDAR -eq 1 ]; then
+    { echo "metrica,valor,unidad"; cut -d, -f1-3 "$RESULTADOS"; } > "$BASE"
+fi
@@ -0,0 +1,119 @@
+/* Comparación de parser.c con libparser.a: primero que den lo mismo para un corpus de líneas
+ * generado al azar, y después cuánto tarda cada uno por línea.
+ * libparser.a se enlaza con tokenize renombrado a tokenize_libparser, lo prepara bench/parser.sh */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../parser.h"
+
+extern tline * tokenize_libparser(char *str);
+
+#define NLINEAS 20000
+#define MAXTOK 24
+
+static const char *palabras[] = { "ls", "-l", "/bin/echo", "a", "b.txt", "grep", "x", "noexiste", "./y", "wc" };
+static const char *simbolos[] = { "<", ">", "|", "&", ">&" };
+
+/* Línea al azar. Se evitan los casos en los que libparser.a lee fuera de su array de tokens (">&" sin fichero) */
+static void
+generar(char *buf) {
+	int n, i, simbolo, anterior_redir = 0;
+	const char *t;
+
+	buf[0] = '\0';
+	n = 1 + rand() % MAXTOK;
+	for (i = 0; i < n; i++) {
+		simbolo = i > 0 && !anterior_redir && rand() % 3 == 0;
+		t = simbolo ? simbolos[rand() % 5] : palabras[rand() % 10];
+		anterior_redir = simbolo && (t[0] == '>');
+		strcat(buf, t);
+		/* A veces sin espacio, el parser tiene que cortar igual por los símbolos */
+		if (rand() % 4 != 0 || anterior_redir) strcat(buf, rand() % 2 ? " " : "\t");
+	}
+	if (anterior_redir) strcat(buf, "f");
+	strcat(buf, "\n");
+}
+
+static int
+iguales_cad(const char *a, const char *b) {
+	if (a == NULL || b == NULL) return a == b;
+	return strcmp(a, b) == 0;
+}
+
+static int
+iguales(tline *a, tline *b) {
+	int i, j;
+	if (a == NULL || b == NULL) return a == b;
+	if (a->ncommands != b->ncommands || a->background != b->background) return 0;
+	if (!iguales_cad(a->redirect_input, b->redirect_input)) return 0;
+	if (!iguales_cad(a->redirect_output, b->redirect_output)) return 0;
+	if (!iguales_cad(a->redirect_error, b->redirect_error)) return 0;
+	for (i = 0; i < a->ncommands; i++) {
+		if (a->commands[i].argc != b->commands[i].argc) return 0;
+		if (!iguales_cad(a->commands[i].filename, b->commands[i].filename)) return 0;
+		for (j = 0; j <= a->commands[i].argc; j++)
+			if (!iguales_cad(a->commands[i].argv[j], b->commands[i].argv[j])) return 0;
+	}
+	return 1;
+}
+
+static double
+ahora_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int
+main(int argc, char *argv[]) {
+	static char lineas[NLINEAS][MAXTOK * 12];
+	char copia[MAXTOK * 12];
+	tarena arena = { NULL, NULL };
+	tline *a, *b;
+	int i, vueltas, fallos = 0, validas = 0;
+	double t0;
+
+	vueltas = argc > 1 ? atoi(argv[1]) : 5;
+	srand(1234);
+	for (i = 0; i < NLINEAS; i++) {
+		/* Una línea "&" al principio de un pipeline hace fallar a libparser.a, se descarta. Tres "<" seguidos
+		 * son un here-string y "&>" la redirección de salida y error, que libparser.a no conoce */
+		do generar(lineas[i]); while (lineas[i][0] == '&' || strstr(lineas[i], "<<<") != NULL || strstr(lineas[i], "&>") != NULL);
+	}
+
+	/* Diferencial, los errores de sintaxis de los dos parsers no interesan aquí */
+	freopen("/dev/null", "w", stderr);
+	for (i = 0; i < NLINEAS; i++) {
+		strcpy(copia, lineas[i]);
+		a = tokenize_libparser(lineas[i]);
+		b = tokenize(copia);
+		if (b != NULL) validas++;
+		if (!iguales(a, b)) {
+			if (fallos++ < 10) printf("distinto: %s", lineas[i]);
+		}
+	}
+	printf("diferencial: %d lineas, %d validas, %d distintas\n", NLINEAS, validas, fallos);
+
+	/* Tiempo por línea. libparser.a y tokenize buscan además cada mandato en el PATH, tokenize_r no */
+	t0 = ahora_ns();
+	for (vueltas *= NLINEAS, i = 0; i < vueltas; i++) tokenize_libparser(lineas[i % NLINEAS]);
+	printf("libparser.a: %.0f ns/linea\n", (ahora_ns() - t0) / vueltas);
+	t0 = ahora_ns();
+	for (i = 0; i < vueltas; i++) {
+		strcpy(copia, lineas[i % NLINEAS]);
+		tokenize(copia);
+	}
+	printf("tokenize: %.0f ns/linea\n", (ahora_ns() - t0) / vueltas);
+	t0 = ahora_ns();
+	for (i = 0; i < vueltas; i++) {
+		strcpy(copia, lineas[i % NLINEAS]);
+		arena_reset(&arena);
+		tokenize_r(copia, &arena);
+	}
+	printf("tokenize_r: %.0f ns/linea\n", (ahora_ns() - t0) / vueltas);
+	arena_liberar(&arena);
+	return fallos != 0;
+}
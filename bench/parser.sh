@@ -0,0 +1,12 @@
+#!/bin/sh
+# Diferencial y ns por línea de parser.c frente a libparser.a
+# Uso: bench/parser.sh [vueltas sobre el corpus]
+
+DIR=$(dirname "$0")/..
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Las dos implementaciones exportan tokenize, la de libparser.a se renombra
+objcopy --redefine-sym tokenize=tokenize_libparser "$DIR/libparser.a" "$TMP/libparser_ren.a" || exit 1
+gcc -O2 -Wall -Wextra -no-pie "$DIR/bench/parser.c" "$DIR/parser.c" "$TMP/libparser_ren.a" -o "$TMP/parser" || exit 1
+"$TMP/parser" "${1:-5}"
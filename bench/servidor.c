@@ -0,0 +1,94 @@
+/* Coste por petición de myshell --serve para quien lo usa, un proceso que ya está en marcha y manda muchos mandatos
+ * (un make, un editor, un servicio), frente a lanzar myshell -c por cada uno desde ese mismo proceso.
+ * Así los dos lados pagan lo mismo fuera de la minishell: ni el fork y exec de un cliente desde sh ni el de sh.
+ * Compilación: gcc -O2 -Wall -Wextra bench/servidor.c -o servidor   Uso: ./servidor socket myshell n mandato
+ * Saca dos líneas, "servidor <ns>" y "proceso <ns>", la media por petición */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double
+ahora_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Lo mismo que hace cliente.c: conectar, mandar la entrada, la salida y el error (SCM_RIGHTS), la línea y esperar el status */
+static int
+peticion(struct sockaddr_un *dir, char *linea, size_t largo) {
+	char byte = 0, control[CMSG_SPACE(3 * sizeof(int))];
+	int fd, status, fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	size_t n;
+	ssize_t leidos;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)dir, sizeof(*dir)) == -1) return -1;
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(fd, &msg, 0) != 1 || write(fd, linea, largo) != (ssize_t)largo) {
+		close(fd);
+		return -1;
+	}
+	shutdown(fd, SHUT_WR);
+	for (n = 0; n < sizeof(status); n += leidos)
+		if ((leidos = read(fd, (char *)&status + n, sizeof(status) - n)) <= 0) break;
+	close(fd);
+	return n == sizeof(status) ? status : -1;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct sockaddr_un dir;
+	char linea[256], *args[4];
+	int i, n, status, fallos = 0;
+	pid_t pid;
+	double t0;
+
+	if (argc != 5 || strlen(argv[1]) >= sizeof(dir.sun_path)) {
+		fprintf(stderr, "Uso: %s socket myshell n mandato\n", argv[0]);
+		return 2;
+	}
+	n = atoi(argv[3]);
+	memset(&dir, 0, sizeof(dir));
+	dir.sun_family = AF_UNIX;
+	strcpy(dir.sun_path, argv[1]);
+	snprintf(linea, sizeof(linea), "%s\n", argv[4]);
+
+	t0 = ahora_ns();
+	for (i = 0; i < n; i++)
+		if (peticion(&dir, linea, strlen(linea)) != 0) fallos++;
+	printf("servidor %.0f\n", (ahora_ns() - t0) / n);
+
+	args[0] = argv[2];
+	args[1] = "-c";
+	args[2] = argv[4];
+	args[3] = NULL;
+	t0 = ahora_ns();
+	for (i = 0; i < n; i++) {
+		if (posix_spawn(&pid, argv[2], NULL, NULL, args, environ) != 0 || waitpid(pid, &status, 0) == -1 || status != 0) fallos++;
+	}
+	printf("proceso %.0f\n", (ahora_ns() - t0) / n);
+	return fallos != 0;
+}
@@ -0,0 +1,170 @@
+/* Resumen por etapa de una traza de la minishell (trace fichero o MYSHELL_TRACE=fichero).
+ * Para cada etapa y mandato: cuánto tardó en crearse desde que se leyó la línea, cuánto vivió
+ * desde que se creó hasta que se recogió, la CPU que gastó y cuántas veces falló.
+ * Compilación: gcc -O2 -Wall -Wextra bench/traza.c -o traza   Uso: ./traza fichero (o la traza por la entrada estándar) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_GRUPOS 256
+#define TAM_PIDS 65536
+
+typedef struct {
+	double * v;
+	int n, tam;
+} tmuestras;
+
+typedef struct {
+	int etapa;
+	char mandato[48];
+	tmuestras lanzamiento;	/* us desde la línea hasta el fork */
+	tmuestras vida;		/* ms desde el fork hasta que se recoge */
+	double cpu;		/* ms de CPU sumados */
+	int fallos;
+} tgrupo;
+
+typedef struct {
+	int pid;		/* 0 si el hueco está libre */
+	long long ns;
+	int grupo;
+} tvivo;
+
+static tgrupo grupos[MAX_GRUPOS];
+static int ngrupos;
+static tvivo vivos[TAM_PIDS];	/* Etapas creadas que no han terminado, por pid */
+static long long *lineas_job;	/* Instante de la línea de cada job, por número de job */
+static unsigned long max_job;
+
+static void
+anadir(tmuestras *m, double x) {
+	if (m->n == m->tam) {
+		m->tam = m->tam == 0 ? 64 : m->tam * 2;
+		m->v = realloc(m->v, m->tam * sizeof(double));
+	}
+	m->v[m->n++] = x;
+}
+
+static int
+comparar(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* media p50 p95 max, o guiones si no hay muestras */
+static void
+imprimir(tmuestras *m) {
+	double suma = 0;
+	int i;
+
+	if (m->n == 0) {
+		printf("  %9s %9s %9s %9s", "-", "-", "-", "-");
+		return;
+	}
+	qsort(m->v, m->n, sizeof(double), comparar);
+	for (i = 0; i < m->n; i++) suma += m->v[i];
+	printf("  %9.1f %9.1f %9.1f %9.1f", suma / m->n, m->v[m->n / 2], m->v[(int)(m->n * 0.95)], m->v[m->n - 1]);
+}
+
+static long long
+numero(const char *linea, const char *clave) {
+	const char *p = strstr(linea, clave);
+	return p != NULL ? strtoll(p + strlen(clave), NULL, 10) : -1;
+}
+
+static void
+cadena(const char *linea, const char *clave, char *buf, size_t tam) {
+	const char *p = strstr(linea, clave);
+	size_t n = 0;
+
+	buf[0] = '\0';
+	if (p == NULL) return;
+	for (p += strlen(clave); *p != '\0' && *p != '"' && n < tam - 1; p++) {
+		if (*p == '\\' && p[1] != '\0') p++;
+		buf[n++] = *p;
+	}
+	buf[n] = '\0';
+}
+
+static int
+grupo(int etapa, const char *mandato) {
+	int i;
+	for (i = 0; i < ngrupos; i++)
+		if (grupos[i].etapa == etapa && strcmp(grupos[i].mandato, mandato) == 0) return i;
+	if (ngrupos == MAX_GRUPOS) return MAX_GRUPOS - 1;	/* Los que no caben se suman al último */
+	grupos[ngrupos].etapa = etapa;
+	snprintf(grupos[ngrupos].mandato, sizeof(grupos[ngrupos].mandato), "%s", mandato);
+	return ngrupos++;
+}
+
+/* Instante de la línea que creó el job. Los números de job son consecutivos y el primer evento de uno nuevo
+ * llega justo después de su línea */
+static long long *
+linea_job(unsigned long job) {
+	unsigned long i;
+	if (job >= max_job) {
+		i = max_job;
+		max_job = job * 2 + 64;
+		lineas_job = realloc(lineas_job, max_job * sizeof(long long));
+		for (; i < max_job; i++) lineas_job[i] = -1;
+	}
+	return &lineas_job[job];
+}
+
+int
+main(int argc, char *argv[]) {
+	FILE *f = stdin;
+	char linea[1024], ev[16], mandato[48];
+	long long ns, ultima_linea = -1, *l = NULL;
+	int pid, etapa, g, i;
+	unsigned long job;
+	tvivo *v;
+
+	if (argc > 1 && (f = fopen(argv[1], "r")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	while (fgets(linea, sizeof(linea), f) != NULL) {
+		cadena(linea, "\"ev\":\"", ev, sizeof(ev));
+		ns = numero(linea, "\"ns\":");
+		pid = numero(linea, "\"pid\":");
+		job = numero(linea, "\"job\":");
+		etapa = numero(linea, "\"etapa\":");
+		if (strcmp(ev, "linea") == 0) {
+			ultima_linea = ns;
+			continue;
+		}
+		l = job != 0 ? linea_job(job) : NULL;
+		if (l != NULL && *l == -1) *l = ultima_linea;
+		if (strcmp(ev, "fork") == 0) {
+			cadena(linea, "\"mandato\":\"", mandato, sizeof(mandato));
+			g = grupo(etapa, mandato);
+			if (l != NULL && *l != -1) anadir(&grupos[g].lanzamiento, (ns - *l) / 1e3);
+			v = &vivos[pid % TAM_PIDS];
+			v->pid = pid;
+			v->ns = ns;
+			v->grupo = g;
+		} else if (strcmp(ev, "exec") == 0 && strstr(linea, "\"ok\":false") != NULL) {
+			cadena(linea, "\"mandato\":\"", mandato, sizeof(mandato));
+			/* Con fork el fallo lo escribe el hijo, que ya tiene su fork en la traza y terminará con exit != 0 */
+			if (pid == -1) grupos[grupo(etapa, mandato)].fallos++;
+		} else if (strcmp(ev, "exit") == 0) {
+			v = &vivos[pid % TAM_PIDS];
+			if (v->pid != pid) continue;	/* Etapa creada antes de empezar la traza */
+			anadir(&grupos[v->grupo].vida, (ns - v->ns) / 1e6);
+			grupos[v->grupo].cpu += numero(linea, "\"cpu_us\":") / 1e3;
+			if (numero(linea, "\"status\":") != 0) grupos[v->grupo].fallos++;
+			v->pid = 0;
+		}
+	}
+
+	printf("%-5s %-16s %7s  %-39s  %-39s  %9s %7s\n", "etapa", "mandato", "n",
+	       "lanzamiento us: media p50 p95 max", "vida ms: media p50 p95 max", "cpu ms", "fallos");
+	for (i = 0; i < ngrupos; i++) {
+		printf("%-5d %-16s %7d", grupos[i].etapa, grupos[i].mandato, grupos[i].vida.n);
+		imprimir(&grupos[i].lanzamiento);
+		imprimir(&grupos[i].vida);
+		printf("  %9.1f %7d\n", grupos[i].cpu, grupos[i].fallos);
+	}
+	return 0;
+}
@@ -0,0 +1,120 @@
+//Autor: Santiago Arias Paniagua
+//Cliente de myshell --serve: manda al servidor su entrada, salida y error estándar y las líneas que hay que ejecutar,
+//y termina con el status que devuelve la sesión. Los mandatos leen y escriben directamente en sus descriptores
+//Compilación: gcc -Wall -Wextra cliente.c -o cliente -static
+//Uso: ./cliente socket [mandato...]. Sin mandato se mandan las líneas de la entrada estándar, como un script
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int conectar(char *ruta);
+int mandar_descriptores(int fd);
+int escribir(int fd, char *buf, size_t n);
+
+int main(int argc, char *argv[]) {
+    int fd, i, status;
+    size_t n;
+    ssize_t leidos;
+    char buf[65536];
+
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s socket [mandato...]\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);  // Si la sesión termina antes (exit), que write falle en vez de matar al cliente
+    fd = conectar(argv[1]);
+    if (fd == -1 || mandar_descriptores(fd) == -1) {
+        fprintf(stderr, "%s: Error. No se pudo conectar con %s, %s\n", argv[0], argv[1], strerror(errno));
+        return 255;
+    }
+
+    if (argc > 2) {
+        // Los argumentos separados por espacios, como una sola línea
+        for (i = 2, n = 0; i < argc && n < sizeof(buf) - 1; i++)
+            n += snprintf(buf + n, sizeof(buf) - n, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+        if (n >= sizeof(buf)) {
+            fprintf(stderr, "%s: Error. Mandato demasiado largo.\n", argv[0]);
+            return 2;
+        }
+        escribir(fd, buf, n);
+    } else {
+        while ((leidos = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+            if (escribir(fd, buf, leidos) == -1) break;
+    }
+    shutdown(fd, SHUT_WR);  // Fin de las líneas, la sesión sale al llegar aquí
+
+    // El status llega después de toda la salida de la sesión
+    for (n = 0; n < sizeof(status); n += leidos) {
+        leidos = read(fd, (char *)&status + n, sizeof(status) - n);
+        if (leidos == -1 && errno == EINTR) {
+            leidos = 0;
+            continue;
+        }
+        if (leidos <= 0) {
+            fprintf(stderr, "%s: Error. La sesión terminó sin devolver el status.\n", argv[0]);
+            return 255;
+        }
+    }
+    return status;
+}
+
+int conectar(char *ruta) {
+    struct sockaddr_un dir;
+    int fd;
+
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    if (strlen(ruta) >= sizeof(dir.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(dir.sun_path, ruta);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&dir, sizeof(dir)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Primer mensaje: un byte con los descriptores 0, 1 y 2 (SCM_RIGHTS)
+int mandar_descriptores(int fd) {
+    char byte = 0;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(fd, &msg, 0) == 1 ? 0 : -1;
+}
+
+int escribir(int fd, char *buf, size_t n) {
+    ssize_t escritos;
+    while (n > 0) {
+        escritos = write(fd, buf, n);
+        if (escritos == -1 && errno == EINTR) continue;
+        if (escritos == -1) return -1;
+        buf += escritos;
+        n -= escritos;
+    }
+    return 0;
+}
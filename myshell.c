@@ -1,6 +1,7 @@
 //Autor: Santiago Arias Paniagua
-//Compilación: gcc -Wall -Wextra myshell.c libparser.a -o myshell -static
+//Compilación: gcc -Wall -Wextra myshell.c parser.c -o myshell -static
 
+#define _GNU_SOURCE  // memfd_create
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,24 +10,342 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <termios.h>
+#include <ctype.h>
 #include "parser.h"
 
+// Tabla de jobs, una entrada por línea lanzada (el pipeline entero) con el pid y el status de cada etapa
+typedef struct {
+    int id;                     // Número del job ([n] en jobs y fg), no cambia mientras el job esté vivo
+    char *nombre;               // Línea completa, para mostrarla en jobs
+    int nprocesos;              // Etapas del pipeline
+    pid_t *pids;                // pid de cada etapa, -1 si no se pudo lanzar y 0 si era un mandato interno que se ejecutó en la minishell
+    int *estados;               // status de cada etapa al terminar, -1 mientras sigue viva
+    struct rusage *usos;        // Recursos de cada etapa al terminar, los que devuelve wait4
+    struct timespec *lanzadas;  // Instante en que se crea cada etapa y en el que se recoge (CLOCK_MONOTONIC)
+    struct timespec *terminadas;
+    cpu_set_t *cpus;            // CPUs en las que sched dejó cada etapa, vacío si no había política
+    unsigned long numero;       // Número de job que no se reutiliza, el que sale en la traza
+    int vivos;                  // Etapas que faltan por terminar
+    int background;
+    struct timespec inicio;     // Lanzamiento y fin del job (CLOCK_MONOTONIC)
+    struct timespec fin;
+} tjob;
+
+// Ficheros de las redirecciones de una línea, abiertos una sola vez en la minishell y con O_CLOEXEC, así ningún hijo hereda
+// los de otras líneas. -1 en los que no hay. 2>&1 y &> no abren nada: la etapa recibe STDOUT_FILENO como error, que el hijo
+// duplica después de poner su salida
+typedef struct {
+    int entrada;                // < fichero o <<< palabra, del primer mandato
+    int salida;                 // > o >> fichero, del último
+    int error;                  // 2>, 2>> o >& fichero, del último
+} tredirecciones;
+
+// Relación pid -> (job, etapa), para recoger cada hijo que termina en O(1)
+#define TAM_PIDS 4096
+typedef struct proceso_job {
+    pid_t pid;
+    tjob *job;
+    int etapa;
+    struct proceso_job *sig;
+} proceso_job;
+
 // Variables globales
-pid_t *pids;                    // Pids de los procesos hijos (background)
-char **nombre_procesos;         // Nombres de los procesos hijos (background)
-pid_t pidfg;                    // Gaurdar el pid que se ejecuta en foreground, para que funcione el manejador
-int num_procesos = 0;           // Numero de procesos hijos (background)
+tjob **jobs_bg;                 // Jobs en background, indexados por id - 1
+int max_jobs = 0;               // Tamaño de jobs_bg, crece al doble cuando se llena
+int *ids_libres;                // Pila de ids que se pueden reutilizar
+int num_ids_libres = 0;
+int num_jobs = 0;               // Jobs en background vivos
+tjob *ultimo_job;               // Último job mandado a background, el que coge fg sin argumentos
+tjob *job_fg;                   // Job que se ejecuta en foreground, para que funcione el manejador
+pid_t captura_fg = -1;          // Subshell del $(...) que se está leyendo, también lo mata el manejador
+proceso_job *tabla_pids[TAM_PIDS];
+int jobs_recogidos = 0;         // Jobs de background que han terminado mientras esperar_job esperaba a otro, recoger_hijos avisa de ellos
+int fd_sigchld;                 // signalfd por el que llegan los SIGCHLD, que están bloqueados
+int fd_epoll;                   // epoll con la entrada estándar y fd_sigchld, para avisar de los jobs terminados mientras se espera una línea
+sigset_t mascara_original;      // Máscara de señales con la que arrancó la minishell, la que heredan los hijos
+posix_spawnattr_t atributos_spawn;
+int interactivo;                // Modo interactivo: clear, banner, prompt y avisos de jobs. Sin él (-c, script o entrada que no es un terminal) solo se ejecutan las líneas
+int entrada_en_epoll = 0;       // La entrada está en fd_epoll (no se puede con ficheros regulares)
+int ultimo_estado = 0;          // Status del último mandato, es el que devuelve la minishell al terminar
+int salida_defecto = -1;        // Salida y error que heredan los mandatos sin redirección (-1, los de la minishell). parallel los cambia para agrupar la salida de cada job
+int error_defecto = -1;
+volatile sig_atomic_t interrumpido = 0;  // Se ha pulsado CTRL + C, para que parallel deje de lanzar jobs
+int medir_tiempo = 0;           // La línea lleva delante time, ejecutar_externo saca el informe por etapas si el job va en foreground
+int fd_sesion = -1;             // Conexión de la sesión de --serve, por la que se devuelve el status al salir
+
+// Lector de líneas con buffer propio y sin límite de longitud, para el terminal, scripts y -c
+typedef struct {
+    int fd;                     // Descriptor del que se lee, -1 si las líneas vienen de una cadena (-c)
+    char *buf;
+    size_t tam;                 // Tamaño reservado de buf
+    size_t ini;                 // Comienzo de lo que queda por devolver
+    size_t fin;                 // Fin de lo leído
+} tlector;
+tlector entrada;
+tarena arena_linea;             // Memoria de la línea que se está ejecutando, se reinicia al leer la siguiente
+char **capturas = NULL;         // Buffers con la salida de los $(...) de la línea, se liberan al leer la siguiente
+int num_capturas = 0;
+int max_capturas = 0;
 int umask_val;                  // El umask con el que la minishell crea los ficheros
 
+// Historia en ~/.myshell_history, compartida por todas las sesiones: solo se añade al final, con una escritura por línea y
+// O_APPEND para que las de varias sesiones no se mezclen. Al arrancar solo se proyecta en memoria, el índice de comienzos de
+// línea se hace la primera vez que hace falta y después solo con lo que se haya añadido desde entonces
+int fd_historia = -1;
+char *mapa_historia = NULL;     // El fichero proyectado, tam_mapa bytes
+size_t tam_mapa = 0;
+size_t *lineas_historia = NULL; // Comienzo de cada entrada en el fichero, y detrás de la última el fin de lo indexado
+int num_historia = 0;           // Entradas indexadas
+int max_historia = 0;
+int *orden_historia = NULL;     // Entradas por orden de su texto, para buscar por prefijo. Las nuevas se ordenan y se mezclan
+int num_ordenadas = 0;
+
+// Editor de línea, con la entrada en un terminal en modo interactivo: el terminal en modo raw mientras se escribe la línea
+typedef struct {
+    char *buf;
+    size_t tam;
+    size_t largo;
+    size_t cursor;              // En bytes, siempre al principio de un carácter UTF-8
+} tedicion;
+tedicion edicion;
+int editor = 0;                 // leer_linea usa el editor en lugar de leer líneas enteras
+int editando = 0;               // El editor espera una tecla, si se avisa de un job hay que volver a sacar la línea
+struct termios termios_original;  // Para volver a dejar el terminal como estaba. CTRL(c) (de termios.h) es la tecla CTRL + c
+extern char **environ;
+
+// Formas de crear los procesos hijos, se puede cambiar en ejecución con el mandato spawn para compararlas
+#define LANZAR_FORK 0           // fork + execv, copia las tablas de páginas de la minishell
+#define LANZAR_SPAWN 1          // posix_spawn, el hijo comparte la memoria hasta el exec
+int modo_lanzamiento = LANZAR_SPAWN;
+
+// Política de planificación de los hijos (mandato sched), se aplica a cada etapa al crearla
+#define PLAN_NINGUNA 0          // Sin afinidad, decide el kernel
+#define PLAN_CPUS 1             // Todas las etapas en el conjunto de CPUs
+#define PLAN_PACK 2             // Una CPU por etapa, seguidas, para que compartan caché
+#define PLAN_SPREAD 3           // Una CPU por etapa, lo más separadas posible
+#define SIN_NICE 100            // Valor de plan_nice para no tocar la prioridad
+int plan_modo = PLAN_NINGUNA;
+cpu_set_t plan_cpus;            // CPUs que pueden usar las etapas, por defecto la afinidad con la que arrancó la minishell
+int plan_lista[CPU_SETSIZE];    // Las mismas en orden, para repartirlas por etapas
+int plan_num = 0;
+int plan_nice = SIN_NICE;       // nice de los hijos
+int plan_ioprio = -1;           // Nivel de E/S best-effort (0-7) de los hijos, -1 si no se toca
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+
+// Traza de ejecución (mandato trace o variable MYSHELL_TRACE): los eventos van a un anillo reservado al empezar
+// y un hilo los escribe en el fichero como líneas JSON, así lanzar un mandato no espera a ninguna escritura
+#define TAM_TRAZA 65536         // Eventos en el anillo, potencia de 2
+#define EV_LINEA 0              // Línea leída y parseada
+#define EV_PIPE 1               // Pipe creado
+#define EV_REDIR 2              // Fichero de redirección abierto
+#define EV_FORK 3               // Proceso de una etapa creado
+#define EV_EXEC 4               // exec hecho o fallido (con fork solo se sabe si falla)
+#define EV_EXIT 5               // Etapa terminada y recogida
+#define EV_JOB 6                // Job terminado entero y liberado
+typedef struct {
+    long long ns;               // CLOCK_MONOTONIC
+    int tipo;
+    pid_t pid;
+    unsigned long job;
+    int etapa;
+    int dato;                   // Según el tipo: fd, status, errno o número de mandatos
+    int extra;                  // Según el tipo: el otro extremo del pipe, el fd al que se redirige o la CPU en microsegundos
+    char texto[48];             // Mandato o fichero, recortado
+} tevento;
+#define TRAZAR(...) do { if (traza != NULL) trazar(__VA_ARGS__); } while (0)
+tevento *traza = NULL;          // Anillo, NULL con la traza apagada
+atomic_ulong traza_cabeza;      // Siguiente evento que se escribe en el anillo, solo lo mueve el hilo principal
+atomic_ulong traza_cola;        // Siguiente evento que pasa al fichero, solo lo mueve el hilo que escribe
+atomic_int traza_terminar;
+unsigned long traza_perdidos;   // Eventos que no cupieron en el anillo
+atomic_ulong traza_sin_escribir;  // Bytes que el hilo que escribe no ha podido pasar al fichero
+int fd_traza = -1;
+int fd_aviso_traza = -1;        // eventfd para despertar al hilo que escribe
+char *fichero_traza;
+pthread_t hilo_traza;
+pid_t pid_minishell;
+unsigned long jobs_creados = 0;
+
+// Tabla hash de mandatos (nombre -> ruta absoluta), para no recorrer el PATH con access() en cada línea
+#define TAM_HASH 256
+typedef struct entrada_hash {
+    char *nombre;               // Nombre del mandato tal y como se escribe
+    char *ruta;                 // Ruta absoluta en la que se encontró
+    int dir;                    // Índice del directorio del PATH en el que está
+    int usos;                   // Veces que se ha usado la entrada
+    struct entrada_hash *sig;   // Siguiente entrada con el mismo hash
+} entrada_hash;
+
+typedef struct {
+    char *ruta;                 // Directorio del PATH
+    struct timespec mtime;      // mtime del directorio cuando se comprobó por última vez
+    unsigned long validado;     // Línea en la que se hizo esa comprobación, como mucho un stat por directorio y línea
+} dir_path;
+
+entrada_hash *tabla_hash[TAM_HASH];
+dir_path *dirs_path;            // Directorios del PATH guardado, en orden
+int num_dirs_path = 0;
+char *path_guardado;            // Copia del PATH con el que se llenó la tabla, si cambia se vacía la tabla
+unsigned long hash_aciertos = 0, hash_fallos = 0;
+unsigned long num_linea = 0;    // Contador de líneas leídas, para no repetir los stat de los directorios
+
+// Variables de la minishell, en una tabla hash con el mismo tamaño y la misma función que la de mandatos. Al arrancar se
+// cargan las del entorno, ya exportadas. Cada una se guarda como "nombre=valor", así el envp de los hijos solo apunta a esas
+// cadenas: se construye una vez y se rehace únicamente cuando cambia una variable exportada
+typedef struct variable {
+    char *cadena;               // "nombre=valor", la que va en el envp
+    size_t largo_nombre;
+    int exportada;
+    struct variable *sig;       // Siguiente variable con el mismo hash
+} tvariable;
+
+tvariable *tabla_variables[TAM_HASH];
+char **envp_cache = NULL;       // Entorno de los hijos, las cadenas de las variables exportadas y NULL al final
+int envp_valido = 0;            // Si es 0 hay que rehacer envp_cache antes de lanzar
+unsigned long envp_construidos = 0;
+char ***prefijos_linea = NULL;  // Asignaciones delante de cada mandato de la línea (VAR=valor mandato), que solo valen para él:
+                                // una lista de "nombre=valor" terminada en NULL por etapa, o NULL si la línea no tiene ninguna
+
+// Caché de listados de directorios para los comodines (*, ?, [...] y **): cada directorio se lee una vez con getdents64, se
+// ordena y se guarda por dispositivo e inodo (así sigue valiendo después de un cd). Se vuelve a leer si cambia su mtime
+#define TAM_GLOB 256
+#define LIMITE_GLOB (64 << 20)  // Bytes de listados guardados, al pasarlo se vacía la caché antes de la siguiente expansión
+#define MARGEN_MTIME 100000000  // ns. El mtime tiene la resolución del tick del kernel: un listado leído antes de este tiempo desde
+                                // el mtime no es fiable, otro cambio en el mismo tick no movería el mtime
+typedef struct {
+    char *nombre;
+    unsigned char tipo;         // d_type, DT_UNKNOWN si el sistema de ficheros no lo da
+} tentrada_dir;
+
+typedef struct dir_glob {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;      // mtime del directorio antes de leerlo
+    int fiable;                 // Se leyó al menos MARGEN_MTIME después del mtime, si no se vuelve a leer en la siguiente expansión
+    unsigned long expansion;    // Última expansión que lo usó, dentro de una misma expansión no se vuelve a leer ni se libera
+    char *buf;                  // Lo que devuelve getdents64, los nombres apuntan aquí
+    size_t tam;
+    tentrada_dir *entradas;     // Sin . ni .., ordenadas con strcmp
+    int num;
+    struct dir_glob *sig;       // Siguiente directorio con el mismo hash
+} dir_glob;
+
+dir_glob *tabla_glob[TAM_GLOB];
+size_t bytes_glob = 0;          // Memoria de los listados guardados
+unsigned long expansion_glob = 0;
+unsigned long glob_aciertos = 0, glob_fallos = 0;
+
+// Argumentos de un mandato que se van juntando al expandir la línea
+typedef struct {
+    char **v;
+    int n;
+    int max;
+} targs;
+
+// Una expansión de comodines: el patrón partido por las / y el camino que se va formando al bajar por los directorios
+typedef struct {
+    char ruta[PATH_MAX];        // Vacío al principio (el directorio actual), cada componente que se añade termina en /
+    char *comps[PATH_MAX / 2];
+    int ncomps;
+    tarena *arena;              // Donde se copian los caminos encontrados, viven lo que la línea
+    targs *args;
+} tcomodines;
+
 // Mandatos internos
-void cd(char *dir);
-void jobs();
-void fg(char *identificador);
+void cd(char **argv);
+void jobs(char **argv);
+void fg(char **argv);
 void chumask(char *mask);
-void help();
+void mandato_umask(char **argv);
+void help(char **argv);
 void salir();
+void mandato_exit(char **argv);
+void mandato_clear(char **argv);
+void hash(char **argv);
+void spawn(char *modo);
+void mandato_spawn(char **argv);
+void sched(char **argv);
+void trace(char **argv);
+void history(char **argv);
+void mandato_export(char **argv);
+void unset(char **argv);
+int leer_cpus(char *lista, cpu_set_t *cpus);
+void formato_cpus(cpu_set_t *cpus, char *buf, size_t tam);
+int cpus_etapa(tjob *job, int etapa, cpu_set_t *cpus);
+void aplicar_plan(pid_t pid, cpu_set_t *cpus);
+int plan_activo();
+int cpu_actual(pid_t pid);
+void tiempo(tline *linea);
+void parallel(tline *linea);
+void echo(char **argv);
+void mandato_printf(char **argv);
+void mandato_true(char **argv);
+void mandato_false(char **argv);
+void pwd(char **argv);
+void test(char **argv);
+int evaluar_test(char **argv, int n);
+
+// Tabla de mandatos internos, los que se buscan en cualquier etapa de la línea antes que en el PATH.
+// time y parallel no están, trabajan con la línea entera y solo valen al principio
+#define INTERNO_PURO 0          // No escribe en la salida ni cambia la minishell: en el propio proceso en cualquier etapa
+#define INTERNO_SALIDA 1        // Solo escribe: en el propio proceso si es la última etapa, si no en un subshell para no bloquear la minishell en el pipe
+#define INTERNO_ESTADO 2        // Cambia la minishell: en el propio proceso solo si va suelto, en un pipeline en un subshell como en bash
+typedef struct {
+    char *nombre;
+    void (*funcion)(char **argv);
+    int tipo;
+} tinterno;
+
+tinterno internos[] = {
+    { "cd", cd, INTERNO_ESTADO },
+    { "jobs", jobs, INTERNO_SALIDA },
+    { "fg", fg, INTERNO_ESTADO },
+    { "umask", mandato_umask, INTERNO_ESTADO },
+    { "exit", mandato_exit, INTERNO_ESTADO },
+    { "clear", mandato_clear, INTERNO_SALIDA },
+    { "help", help, INTERNO_SALIDA },
+    { "hash", hash, INTERNO_ESTADO },
+    { "spawn", mandato_spawn, INTERNO_ESTADO },
+    { "sched", sched, INTERNO_ESTADO },
+    { "trace", trace, INTERNO_ESTADO },
+    { "history", history, INTERNO_SALIDA },
+    { "export", mandato_export, INTERNO_ESTADO },
+    { "unset", unset, INTERNO_ESTADO },
+    { "echo", echo, INTERNO_SALIDA },
+    { "printf", mandato_printf, INTERNO_SALIDA },
+    { "pwd", pwd, INTERNO_SALIDA },
+    { "true", mandato_true, INTERNO_PURO },
+    { "false", mandato_false, INTERNO_PURO },
+    { "test", test, INTERNO_PURO },
+    { "[", test, INTERNO_PURO },
+    { NULL, NULL, 0 }
+};
+int subshell = 0;               // Proceso hijo que ejecuta un mandato interno de un pipeline, sin jobs propios
 
 // Manejador de señales
 void manejador_sigint();
@@ -34,25 +353,161 @@ void manejador_sigint();
 // Funciones
 void prompt();
 void loop();
+void servir(char *ruta);
+void sesion(int conexion);
 tline *leer_linea();
+char *siguiente_linea(tlector *l);
+char *editar_linea();
+int leer_tecla();
+void redibujar();
+void mostrar_busqueda(char *texto, size_t largo, int encontrada);
+void poner_linea(char *texto, size_t largo);
+void abrir_historia();
+int sincronizar_historia();
+char *entrada_historia(int i, size_t *largo);
+void anadir_historia(char *linea);
+char *expandir_historia(char *linea);
+int buscar_historia(char *texto, size_t largo, int desde);
+void ordenar_historia();
+int comparar_historia(const void *a, const void *b);
+int comparar_enteros(const void *a, const void *b);
+int expandir_linea(tline *linea, tarena *arena);
+char *expandir_palabra(char *palabra);
+char *fin_sustitucion(char *p);
+int capturar(char *texto, char **buf, size_t *n, size_t *tam);
+void reservar(char **buf, size_t *tam, size_t necesario);
+void liberar_capturas();
+void anadir_arg(targs *args, char *arg);
+int es_patron(char *p);
+int expandir_comodines(char *patron, tarena *arena, targs *args);
+void buscar_comodines(tcomodines *c, size_t n, int i);
+void buscar_globstar(tcomodines *c, size_t n, int i);
+void anadir_camino(tcomodines *c, size_t n, char *nombre);
+int es_directorio(tcomodines *c, size_t n, tentrada_dir *e, int seguir);
+dir_glob *listar_dir(char *ruta);
+void leer_dir(dir_glob *d, int fd);
+int comparar_entradas(const void *a, const void *b);
+int comparar_cadenas(const void *a, const void *b);
+void vaciar_glob();
+int entrada_cadena(char *cadena);
 void ejecutar_interno(tline *linea);
 void ejecutar_externo(tline *linea);
-void ejecutar_pipe(tline *linea, int restantes, int entrada);
-int ficheroredireccion(tline *linea, int tipo);
-void comprobar_procesos_terminados();
+tjob *lanzar_job(tline *linea);
+void lanzar_etapa(tline *linea, tjob *job, int etapa, int entrada, int salida, int error, int cerrar);
+tinterno *buscar_interno(char *nombre);
+void ejecutar_en_proceso(tinterno *interno, char **argv, int salida, int error, char **prefijos);
+void ejecutar_suelto(tline *linea, tinterno *interno);
+void ejecutar_pipe(tline *linea, int restantes, int entrada, tjob *job, tredirecciones *redir);
+pid_t lanzar(tcommand *mandato, int entrada, int salida, int error, int cerrar, tjob *job, int etapa);
+int abrir_redirecciones(tline *linea, tredirecciones *redir);
+int abrir_entrada(tline *linea);
+int abrir_salida(tline *linea, char *fichero, int anadir);
+void cerrar_redirecciones(tredirecciones *redir);
+void trazar_redirecciones(tline *linea, tjob *job, tredirecciones *redir);
+void inicializar_jobs();
+void esperar_entrada();
+int recoger_hijos(int nueva_linea);
+tjob *nuevo_job(tline *linea);
+void anadir_proceso(tjob *job, int etapa, pid_t pid);
+proceso_job *quitar_proceso(pid_t pid);
+void marcar_terminado(tjob *job, int etapa, int status, struct rusage *uso);
+void registrar_job(tjob *job);
+void liberar_job(tjob *job);
+void esperar_job(tjob *job);
+void notificar_job(tjob *job);
+void informe_etapa(FILE *f, tjob *job, int etapa);
+void informe_job(tjob *job);
+double segundos(struct timespec *inicio, struct timespec *fin);
+char *buscar_mandato(char *nombre);
+char *buscar_en_path(char *nombre, char *path);
+void resolver_mandatos(tline *linea);
+void vaciar_hash();
+void comprobar_path();
+int dir_modificado(int i);
+unsigned int funcion_hash(char *s);
+void cargar_entorno();
+unsigned int hash_variable(char *nombre, size_t largo);
+tvariable *buscar_variable(char *nombre, size_t largo);
+char *valor_variable(char *nombre);
+void asignar_variable(char *nombre, size_t largo, char *valor, int exportar);
+void borrar_variable(char *nombre, size_t largo);
+int es_asignacion(char *palabra);
+char **entorno();
+char **entorno_mandato(char **prefijos);
+char **prefijos_etapa(int etapa);
+int comparar_variables(const void *a, const void *b);
+int iniciar_traza(char *fichero);
+void parar_traza();
+void trazar(int tipo, pid_t pid, tjob *job, int etapa, int dato, int extra, const char *texto);
+void trazar_hijo(int tipo, tjob *job, int etapa, int dato, const char *texto);
+void avisar_traza();
+void *escritor_traza(void *arg);
+void escribir_traza(char *buf, size_t n);
+size_t formato_evento(tevento *ev, char *buf, size_t tam);
+tline *copiar_linea(tarena *arena, tline *linea, char *arg, int anadir);
+char *sustituir(tarena *arena, char *palabra, char *arg);
+void volcar_salida(int fd, int destino);
+
+//Función principal, elegir el modo (interactivo, -c o script), inicializar la tabla de jobs y el umask de la minishell
+int main(int argc, char *argv[]) {
+    int i = 1;
+    int forzar_interactivo = 0;
+    char *socket_servidor = NULL;
+
+    if (i < argc && strcmp(argv[i], "--serve") == 0) {  // Servidor: las líneas llegan por un socket, sin terminal
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s: --serve: Error: falta el socket.\n", argv[0]);
+            return 2;
+        }
+        socket_servidor = argv[i + 1];
+        i = argc;
+    }
+    if (i < argc && strcmp(argv[i], "-i") == 0) {  // Modo interactivo aunque la entrada no sea un terminal
+        forzar_interactivo = 1;
+        i++;
+    }
+    entrada.fd = STDIN_FILENO;
+    if (i < argc && strcmp(argv[i], "-c") == 0) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s: -c: Error: falta el mandato.\n", argv[0]);
+            return 2;
+        }
+        entrada.fd = -1;  // Las líneas salen de la propia cadena
+        entrada.buf = strdup(argv[i + 1]);
+        entrada.fin = strlen(entrada.buf);
+        entrada.tam = entrada.fin + 1;
+    } else if (i < argc) {
+        entrada.fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (entrada.fd == -1) {
+            fprintf(stderr, "%s: Error. No se pudo abrir el script %s, %s\n", argv[0], argv[i], strerror(errno));
+            return 127;
+        }
+    }
+    interactivo = socket_servidor == NULL && (forzar_interactivo || (entrada.fd == STDIN_FILENO && isatty(STDIN_FILENO)));
+    cargar_entorno();
+
+    if (interactivo) system("clear");
+    if (interactivo) abrir_historia();
+    editor = interactivo && entrada.fd == STDIN_FILENO && isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &termios_original) == 0;
 
-//Función principal, inicializar la variable de entorno, los arrays de memoria dinámica y el umask de la minishell
-int main() {
-    system("clear");
+    // Inicializar la tabla de jobs y la recogida de hijos por signalfd
+    inicializar_jobs();
+    sched_getaffinity(0, sizeof(plan_cpus), &plan_cpus);  // CPUs por defecto para sched
+    for (i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &plan_cpus)) plan_lista[plan_num++] = i;
 
-    // Inicializar variables globales de memoria dinámica
-    pids = (pid_t *)malloc(sizeof(pid_t));
-    nombre_procesos = (char **)malloc(sizeof(char *));
+    // Forma de lanzar los procesos, se puede elegir con la variable de entorno MYSHELL_SPAWN (fork o posix_spawn)
+    if (getenv("MYSHELL_SPAWN") != NULL) spawn(getenv("MYSHELL_SPAWN"));
 
     // Inicializar el umask de la minishell, por defecto: archivos: 644 (rw-r--r--) directorios: 755 (rwxr-xr-x)
     chumask("022");
 
-    printf("\x1b[35m------- Minishell - Santiago Arias ------\n");
+    // Traza desde el principio, antes de la primera línea
+    if (getenv("MYSHELL_TRACE") != NULL) iniciar_traza(getenv("MYSHELL_TRACE"));
+
+    if (socket_servidor != NULL) servir(socket_servidor);  // No vuelve, cada conexión sigue en loop() en su propio proceso
+
+    if (interactivo) printf("\x1b[35m------- Minishell - Santiago Arias ------\n");
     // Loop principal
     loop();
  
@@ -70,316 +525,3117 @@ void prompt() {
 void loop() {
     tline *line;
     
+    if (interactivo) signal(SIGINT, SIG_IGN);  // Ignorar CTRL + C, esperar_job lo vuelve a dejar así. Sin modo interactivo CTRL + C termina la minishell, como en cualquier script
     while (1) {
-        prompt();                   // Imprimir el prompt
-        signal(SIGINT, SIG_IGN);    // Ignorar CTRL + C
-
+        if (interactivo) {
+            prompt();               // Imprimir el prompt
+            if (!editor) esperar_entrada();  // Avisar de los jobs que terminen mientras se escribe la línea, el editor lo hace en cada tecla
+        }
         line = leer_linea();
+        num_linea++;
         if (line != NULL) {
-            comprobar_procesos_terminados();
-            waitpid(-1, NULL, WNOHANG); // Limpiar los procesos zombies que queden, normalmente después de pipes
+            TRAZAR(EV_LINEA, pid_minishell, NULL, -1, line->ncommands, 0, line->commands[0].argv[0]);
+            if (num_jobs > 0) recoger_hijos(0);  // Los que hayan terminado sin que se estuviera esperando en el prompt, sin jobs no hace falta ni mirar
             ejecutar_interno(line);
+            if (traza != NULL) avisar_traza();  // Los eventos de la línea al fichero mientras se lee la siguiente
+        }
+    }
+}
+
+// Modo servidor (--serve socket): acepta conexiones en un socket UNIX con un proceso por cada una, que ya tiene
+// la tabla de jobs, el umask y el sched de la minishell hechos. Así cada cliente se ahorra arrancar la minishell
+// y las sesiones no comparten directorio, umask ni jobs. Hay siempre SESIONES_LIBRES procesos creados de antemano
+// esperando en accept(), para que el fork no caiga en la latencia de la petición. El bucle solo repone los que
+// cogen una conexión (avisan por un pipe) y recoge las sesiones que terminan
+#define SESIONES_LIBRES 4
+void servir(char *ruta) {
+    struct sockaddr_un dir;
+    struct stat st;
+    struct epoll_event ev, evs[2];
+    int fd, aviso[2], libres = 0, i, n;
+    char bytes[SESIONES_LIBRES];
+    ssize_t cogidas;
+    pid_t pid;
+
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    if (strlen(ruta) >= sizeof(dir.sun_path)) {
+        fprintf(stderr, "--serve: Error. Ruta demasiado larga: %s\n", ruta);
+        exit(2);
+    }
+    strcpy(dir.sun_path, ruta);
+    if (lstat(ruta, &st) == 0) {  // El de un servidor anterior se quita, cualquier otra cosa se deja como está
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "--serve: Error. %s existe y no es un socket.\n", ruta);
+            exit(1);
+        }
+        unlink(ruta);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&dir, sizeof(dir)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "--serve: Error. No se pudo escuchar en %s, %s\n", ruta, strerror(errno));
+        exit(1);
+    }
+    if (pipe2(aviso, O_CLOEXEC) == -1) {
+        perror("--serve: Error");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = aviso[0];
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, aviso[0], &ev);  // Junto a fd_sigchld
+    while (1) {
+        for (; libres < SESIONES_LIBRES; libres++) {
+            pid = fork();
+            if (pid == 0) {
+                close(aviso[0]);
+                prctl(PR_SET_PDEATHSIG, SIGTERM);  // Si se para el servidor, las que no tienen cliente sobran
+                if (getppid() == 1) _exit(0);
+                while ((i = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) == -1 && errno == EINTR);
+                prctl(PR_SET_PDEATHSIG, 0);
+                if (write(aviso[1], "", 1) != 1 || i == -1) _exit(1);
+                close(aviso[1]);
+                close(fd);
+                sesion(i);
+            }
+            if (pid == -1) {
+                fprintf(stderr, "--serve: Error al crear la sesión, %s\n", strerror(errno));
+                break;
+            }
+        }
+        n = epoll_wait(fd_epoll, evs, 2, -1);
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.fd == fd_sigchld) recoger_hijos(0);  // Las sesiones no son de ningún job, solo se recogen
+            else if ((cogidas = read(aviso[0], bytes, sizeof(bytes))) > 0) libres -= cogidas;
         }
     }
 }
 
+// Proceso de una conexión: el primer mensaje trae la entrada, la salida y el error del cliente (SCM_RIGHTS),
+// que pasan a ser los de la sesión, y el resto son las líneas, que se ejecutan como un script. Los mandatos escriben
+// directamente en los descriptores del cliente y salir() devuelve el status por la conexión
+void sesion(int conexion) {
+    char byte;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct epoll_event ev;
+    int fds[3], i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(conexion, &msg, MSG_CMSG_CLOEXEC) != 1) _exit(1);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) _exit(1);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    for (i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        if (fds[i] > 2) close(fds[i]);
+    }
+    fd_sesion = conexion;
+    entrada.fd = conexion;
+
+    // El epoll lo comparte con el servidor, la sesión necesita uno propio
+    close(fd_epoll);
+    fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd_sigchld;
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_sigchld, &ev);
+    // El hilo de la traza no pasa el fork, se vuelve a empezar en el mismo fichero
+    if (traza != NULL) {
+        close(fd_traza);
+        close(fd_aviso_traza);
+        free(traza);
+        traza = NULL;
+        iniciar_traza(fichero_traza);
+    }
+    loop();
+}
+
 tline *leer_linea() {
-    char buffer[1024];
+    char *buffer;
+    tline *linea;
 
-    fgets(buffer, 1024, stdin);
-    if (feof(stdin)) salir();                   // Si se manda CTRL + D, se sale de la minishell
-    if (buffer[0] == '\n') return NULL;         // Si no se ha introducido nada, volver a pedir entrada
-    else if (buffer[0] == ' ') return NULL;     // Si se ha introducido un espacio, volver a pedir entrada
-    else if (buffer[0] == '\t') return NULL;    // Si se ha introducido un tab, volver a pedir entrada
-    return tokenize(buffer);                    // Devolver la línea tokenizada
+    buffer = editor ? editar_linea() : siguiente_linea(&entrada);
+    if (buffer == NULL) salir();                // Si se manda CTRL + D o se acaba el script, se sale de la minishell
+    while (*buffer == ' ' || *buffer == '\t') buffer++;
+    if (buffer[0] == '\0') return NULL;         // Si no se ha introducido nada, volver a pedir entrada
+    arena_reset(&arena_linea);                  // Lo de la línea anterior ya no se usa
+    liberar_capturas();
+    prefijos_linea = NULL;
+    if (interactivo) {
+        // !! y !n solo al escribir, como en bash. A la historia va la línea ya expandida
+        if (strchr(buffer, '!') != NULL && (buffer = expandir_historia(buffer)) == NULL) {
+            ultimo_estado = 1;
+            return NULL;
+        }
+        anadir_historia(buffer);
+    }
+    if (buffer[0] == '#') return NULL;          // Comentarios, también la línea #! de los scripts
+    linea = tokenize_r(buffer, &arena_linea);   // Devolver la línea tokenizada, los argumentos apuntan dentro del buffer del lector
+    if (linea != NULL && linea->ncommands > 0 && expandir_linea(linea, &arena_linea) == -1) return NULL;
+    if (linea != NULL && linea->ncommands == 0) return NULL;  // Líneas con solo símbolos, como "&", o cuyo mandato era un $(...) vacío
+    return linea;
 }
 
-// Comprobar si hay algun proceso hijo terminado, para ir limpiando el array de background según terminan, un "cosechador" por así decirlo
-void comprobar_procesos_terminados() {
-    int i, j;
-    for (i = 0; i < num_procesos; i++) {
-        if (waitpid(pids[i], NULL, WNOHANG) != 0) { // WNOHANG testea si el hijo pid[i] ha terminado, si hubiera terminado, el status no me interesa
-            // Mantener el orden de los procesos por cómo se ha implementado fg
-            for (j = i; j < num_procesos; j++) {
-                pids[j] = pids[j + 1];
-                nombre_procesos[j] = nombre_procesos[j + 1];
+// Sustitución de mandatos, variables y comodines: cambiar cada $(...), $VAR, ${VAR} y $? de los argumentos, las redirecciones
+// y el here-string (ver expandir_palabra). En los argumentos el resultado se parte en varios por espacios, tabuladores y saltos
+// de línea (no hay comillas que lo eviten), escribiendo los \0 en el propio buffer de la expansión, y después cada uno con
+// comodines se cambia por los caminos que casan con él, o se deja como está si no casa ninguno, como en sh.
+// Las asignaciones del principio de cada mandato (VAR=valor) se quitan del argv: sin nada detrás se hacen en la minishell, y si
+// no van a prefijos_linea para el entorno de ese mandato. Devuelve -1 si hay un error, y deja la línea sin mandatos si el único
+// que había se ha quedado sin argumentos
+int expandir_linea(tline *linea, tarena *arena) {
+    tcommand *mandato;
+    char *buf, *p, **prefijos;
+    int i, j, k, largo;
+    targs args;
+
+    prefijos_linea = NULL;
+    for (i = 0; i < linea->ncommands; i++) {
+        mandato = &linea->commands[i];
+        for (j = 0; j < mandato->argc && strpbrk(mandato->argv[j], "$*?[") == NULL; j++);
+        // Lo normal, sin sustituciones, variables, comodines ni asignaciones el argv se queda como está
+        if (j == mandato->argc && (mandato->argc == 0 || es_asignacion(mandato->argv[0]) == 0)) continue;
+        // Asignaciones, el valor se expande entero, sin partir ni comodines
+        for (k = 0; k < mandato->argc && es_asignacion(mandato->argv[k]) > 0; k++);
+        if (k > 0) {
+            if (prefijos_linea == NULL) {
+                prefijos_linea = arena_alloc(arena, linea->ncommands * sizeof(char **));
+                memset(prefijos_linea, 0, linea->ncommands * sizeof(char **));
+            }
+            prefijos = prefijos_linea[i] = arena_alloc(arena, (k + 1) * sizeof(char *));
+            for (j = 0; j < k; j++) {
+                prefijos[j] = mandato->argv[j];
+                if (strchr(mandato->argv[j], '$') != NULL && (prefijos[j] = expandir_palabra(mandato->argv[j])) == NULL) return -1;
             }
-            num_procesos--;
-            pids = (int *)realloc(pids, (num_procesos + 1) * sizeof(int)); // +1 es por cómo he implementado el añadir a esta "lista"
-            nombre_procesos = (char **)realloc(nombre_procesos, (num_procesos + 1) * sizeof(char *));
+            prefijos[k] = NULL;
+        }
+        args.v = NULL;
+        args.n = args.max = 0;
+        for (j = k; j < mandato->argc; j++) {
+            if (strchr(mandato->argv[j], '$') == NULL) {
+                buf = mandato->argv[j];
+            } else if ((buf = expandir_palabra(mandato->argv[j])) == NULL) {
+                free(args.v);
+                return -1;
+            }
+            for (p = buf + strspn(buf, " \t\n"); *p != '\0'; p += strspn(p, " \t\n")) {
+                buf = p;
+                p += strcspn(p, " \t\n");
+                if (*p != '\0') *p++ = '\0';
+                if (!es_patron(buf) || expandir_comodines(buf, arena, &args) == 0) anadir_arg(&args, buf);
+            }
+        }
+        mandato->argv = arena_alloc(arena, (args.n + 1) * sizeof(char *));
+        if (args.n > 0) memcpy(mandato->argv, args.v, args.n * sizeof(char *));  // args.v es NULL si todo se ha quedado en nada
+        mandato->argv[args.n] = NULL;
+        mandato->argc = args.n;
+        free(args.v);
+        if (args.n == 0 && linea->ncommands > 1) {
+            fprintf(stderr, "Error: mandato vacío en el pipeline.\n");
+            return -1;
         }
     }
+    if (linea->ncommands == 1 && linea->commands[0].argc == 0) {
+        // Solo asignaciones: variables de la minishell (exportadas si ya lo estaban)
+        for (j = 0; prefijos_linea != NULL && prefijos_linea[0][j] != NULL; j++) {
+            largo = es_asignacion(prefijos_linea[0][j]);
+            asignar_variable(prefijos_linea[0][j], largo, prefijos_linea[0][j] + largo + 1, -1);
+        }
+        if (prefijos_linea != NULL) ultimo_estado = 0;
+        prefijos_linea = NULL;
+        linea->ncommands = 0;
+    }
+    // Los ficheros y el here-string se quedan enteros, sin partir
+    if (linea->redirect_input != NULL && strchr(linea->redirect_input, '$') != NULL &&
+        (linea->redirect_input = expandir_palabra(linea->redirect_input)) == NULL) return -1;
+    if (linea->redirect_output != NULL && strchr(linea->redirect_output, '$') != NULL &&
+        (linea->redirect_output = expandir_palabra(linea->redirect_output)) == NULL) return -1;
+    if (linea->redirect_error != NULL && strchr(linea->redirect_error, '$') != NULL &&
+        (linea->redirect_error = expandir_palabra(linea->redirect_error)) == NULL) return -1;
+    if (linea->redirect_string != NULL && strchr(linea->redirect_string, '$') != NULL &&
+        (linea->redirect_string = expandir_palabra(linea->redirect_string)) == NULL) return -1;
+    return 0;
 }
 
-// Manejador CTRL + C
-void manejador_sigint() {
-    // Salir solo del proceso en foreground, no de la minishell
-    kill(pidfg, SIGKILL);
-    printf("\n");
+// La palabra con cada $(...) cambiado por la salida del mandato, $VAR y ${VAR} por el valor de la variable (nada si no existe)
+// y $? por el status del último mandato, en un buffer que vale hasta la siguiente línea. Un $ con otra cosa detrás se queda
+// como está. NULL si algún $( o ${ no se cierra o si se interrumpe un $(...) con CTRL + C
+char *expandir_palabra(char *palabra) {
+    char *buf = NULL, *p = palabra, *inicio, *fin, *valor;
+    size_t n = 0, tam = 0, largo;
+    tvariable *v;
+    char estado[16];
+
+    while ((inicio = strchr(p, '$')) != NULL) {
+        reservar(&buf, &tam, n + (inicio - p) + 1);
+        memcpy(buf + n, p, inicio - p);
+        n += inicio - p;
+        valor = NULL;
+        if (inicio[1] == '(') {
+            fin = fin_sustitucion(inicio + 2);
+            if (fin == NULL) {
+                fprintf(stderr, "%s: Error de sintaxis, falta el ) de $(.\n", palabra);
+                free(buf);
+                return NULL;
+            }
+            *fin = '\0';
+            if (capturar(inicio + 2, &buf, &n, &tam) == -1) {
+                free(buf);
+                return NULL;
+            }
+            p = fin + 1;
+            continue;
+        } else if (inicio[1] == '?') {
+            snprintf(estado, sizeof(estado), "%d", ultimo_estado);
+            valor = estado;
+            p = inicio + 2;
+        } else if (inicio[1] == '{') {
+            fin = strchr(inicio + 2, '}');
+            if (fin == NULL) {
+                fprintf(stderr, "%s: Error de sintaxis, falta la } de ${.\n", palabra);
+                free(buf);
+                return NULL;
+            }
+            v = buscar_variable(inicio + 2, fin - inicio - 2);
+            if (v != NULL) valor = v->cadena + v->largo_nombre + 1;
+            p = fin + 1;
+        } else if (isalpha((unsigned char)inicio[1]) || inicio[1] == '_') {
+            for (fin = inicio + 1; isalnum((unsigned char)*fin) || *fin == '_'; fin++);
+            v = buscar_variable(inicio + 1, fin - inicio - 1);
+            if (v != NULL) valor = v->cadena + v->largo_nombre + 1;
+            p = fin;
+        } else {
+            buf[n++] = '$';
+            p = inicio + 1;
+        }
+        if (valor != NULL) {
+            largo = strlen(valor);
+            reservar(&buf, &tam, n + largo);
+            memcpy(buf + n, valor, largo);
+            n += largo;
+        }
+    }
+    largo = strlen(p);
+    reservar(&buf, &tam, n + largo + 1);
+    memcpy(buf + n, p, largo + 1);
+    if (num_capturas == max_capturas) {
+        max_capturas = max_capturas == 0 ? 16 : max_capturas * 2;
+        capturas = (char **)realloc(capturas, max_capturas * sizeof(char *));
+    }
+    capturas[num_capturas++] = buf;
+    return buf;
 }
 
-void ejecutar_interno(tline *linea) {
-    // Comprobar si el mandato es interno
-    if (strcmp(linea->commands[0].argv[0], "cd") == 0) cd(linea->commands[0].argv[1]);
-    else if (strcmp(linea->commands[0].argv[0], "jobs") == 0) jobs();
-    else if (strcmp(linea->commands[0].argv[0], "fg") == 0) fg(linea->commands[0].argv[1]);
-    else if (strcmp(linea->commands[0].argv[0], "umask") == 0) chumask(linea->commands[0].argv[1]);
-    else if (strcmp(linea->commands[0].argv[0], "exit") == 0) salir();
-    else if (strcmp(linea->commands[0].argv[0], "clear") == 0) system("clear");
-    else if(strcmp(linea->commands[0].argv[0], "help") == 0) help();
-    else ejecutar_externo(linea); // Ejecutar mandato externo
+// El ) que cierra un $( cuyo contenido empieza en p, contando los paréntesis anidados como hace el parser. NULL si no está
+char *fin_sustitucion(char *p) {
+    int nivel = 1;
+    for (; *p != '\0'; p++) {
+        if (*p == '(') nivel++;
+        else if (*p == ')' && --nivel == 0) return p;
+    }
+    return NULL;
 }
 
-// Implementación cd
-void cd(char *dir) {
-    if (dir == NULL) {
-        if (chdir(getenv("HOME")) != 0) {
-            perror("cd");
-            return;
+// Ejecutar el texto como una línea en un subshell con la salida estándar en un pipe y añadir lo que escriba a buf, sin los
+// saltos de línea del final, como en sh. Se lee directamente en buf, que crece al doble cuando se llena, sin buffers intermedios
+// ni ficheros. Los \0 se quitan, un argumento no puede llevarlos. Devuelve -1 si se ha interrumpido con CTRL + C
+int capturar(char *texto, char **buf, size_t *n, size_t *tam) {
+    int fd[2];
+    pid_t pid;
+    ssize_t leidos;
+    char *p, *q;
+    size_t inicio = *n;
+    tarena arena = { NULL, NULL };
+    tline *linea;
+
+    if (pipe2(fd, O_CLOEXEC) != 0) {
+        fprintf(stderr, "$(%s): Error al crear el pipe, %s\n", texto, strerror(errno));
+        return 0;
+    }
+    fcntl(fd[0], F_SETPIPE_SZ, 1 << 20);  // Con capturas grandes, menos vueltas entre el mandato y la minishell
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        // Subshell con la salida en el pipe, sin prompt ni avisos, sin jobs propios ni traza. CTRL + C lo termina
+        // a él y a lo que lance, como a cualquier mandato
+        signal(SIGINT, SIG_DFL);
+        subshell = 1;
+        interactivo = 0;
+        traza = NULL;
+        dup2(fd[1], STDOUT_FILENO);
+        close(fd[0]);
+        close(fd[1]);
+        linea = tokenize_r(texto, &arena);
+        if (linea == NULL) _exit(2);
+        if (linea->ncommands > 0 && expandir_linea(linea, &arena) == 0 && linea->ncommands > 0) ejecutar_interno(linea);
+        fflush(stdout);
+        _exit(ultimo_estado);
+    }
+    close(fd[1]);
+    if (pid == -1) {
+        fprintf(stderr, "$(%s): Error al crear el proceso, %s\n", texto, strerror(errno));
+        close(fd[0]);
+        return 0;
+    }
+    captura_fg = pid;
+    interrumpido = 0;
+    if (interactivo) signal(SIGINT, manejador_sigint);  // Como en esperar_job, para poder matarlo con CTRL + C
+    while (1) {
+        if (*tam - *n < 65536) reservar(buf, tam, *n + 65536);
+        leidos = read(fd[0], *buf + *n, *tam - *n - 1);
+        if (leidos == -1 && errno == EINTR) continue;
+        if (leidos <= 0) break;
+        if ((p = memchr(*buf + *n, '\0', leidos)) != NULL) {
+            for (q = p; p < *buf + *n + leidos; p++)
+                if (*p != '\0') *q++ = *p;
+            leidos = q - (*buf + *n);
         }
+        *n += leidos;
     }
-    else if (chdir(dir) != 0) {
-        fprintf(stderr, "cd: Error: no se ha podido cambiar al directorio %s\n", dir);
-        return;
+    close(fd[0]);
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+    captura_fg = -1;
+    if (interactivo) signal(SIGINT, SIG_IGN);
+    if (interrumpido) {  // La línea no se ejecuta, como en bash
+        interrumpido = 0;
+        ultimo_estado = 128 + SIGINT;
+        return -1;
     }
+    while (*n > inicio && (*buf)[*n - 1] == '\n') (*n)--;
+    return 0;
 }
 
-// Implementación jobs
-void jobs() {
-    int i;
-    for (i = 0; i < num_procesos; i++) {
-        // Comprobar si el proceso está activo
-        // WNOHANG testea si el hijo pid[i] ha terminado, si no ha terminado, devuelve 0, no nos interesa el status así que ni lo compruebo
-        if (waitpid(pids[i], NULL, WNOHANG) == 0) printf("[%d] Running        %s&\n", i + 1, nombre_procesos[i]);
+// Que en buf quepan al menos necesario bytes, doblando el tamaño
+void reservar(char **buf, size_t *tam, size_t necesario) {
+    if (*tam >= necesario) return;
+    if (*tam == 0) *tam = 4096;
+    while (*tam < necesario) *tam *= 2;
+    *buf = (char *)realloc(*buf, *tam);
+    if (*buf == NULL) {
+        perror("Fatal Error");
+        exit(1);
     }
 }
 
-// Implementación fg
-void fg(char *identificador) {
-    pid_t pidv;
-    if (identificador != NULL) pidv = pids[atoi(identificador) - 1]; // Por cómo está implementada la lista, siempre será uno menos
-    else pidv = pids[num_procesos - 1];
-
-    if (waitpid(pidv, NULL, WNOHANG) == 0) { // Para evitar error si la lista está vacía o el proceso que le mandamos no está activo
-        pidfg = pidv;
-        signal(SIGINT, manejador_sigint); // En caso de que se haga ctrl + c, se matará a este pid en concreto
-        printf("%s\n", nombre_procesos[num_procesos - 1]);
-        waitpid(pidv, NULL, 0);
-        return;
+void liberar_capturas() {
+    while (num_capturas > 0) free(capturas[--num_capturas]);
+}
+
+void anadir_arg(targs *args, char *arg) {
+    if (args->n == args->max) {
+        args->max = args->max == 0 ? 16 : args->max * 2;
+        args->v = (char **)realloc(args->v, args->max * sizeof(char *));
     }
+    args->v[args->n++] = arg;
+}
 
-    fprintf(stderr, "fg: No hay ningún proceso en segundo plano o no se ha podido ejecutar el pid proporcionado en primer plano.\n");
+// Tiene algún comodín: *, ? o un [ con su ] detrás (un [ suelto, como el mandato [, se deja como está)
+int es_patron(char *p) {
+    for (p += strcspn(p, "*?["); *p != '\0'; p += 1 + strcspn(p + 1, "*?[")) {
+        if (*p != '[' || strchr(p + 1, ']') != NULL) return 1;
+    }
+    return 0;
 }
 
-// Implementación umask
-void chumask(char *mask) {
-    int mascara;
-    // Comprobar si se ha pasado un argumento y si es válido
-    if (mask != NULL) {
-        // Comprobar si es un número
-        if (sscanf(mask, "%o", &mascara) != 1) {  // %o para que se lea como octal
-            fprintf(stderr, "umask: Error: el argumento proporcionado no es un octal.\n");
-            return;
-        }
-        // Comprobar si es un número válido
-        if (mascara < 0000 || mascara > 0777) {
-            fprintf(stderr, "umask: Error: el argumento proporcionado no es una máscara válida.\n");
-            return;
+// Añadir a args los caminos que casan con el patrón, ordenados. Devuelve cuántos hay
+int expandir_comodines(char *patron, tarena *arena, targs *args) {
+    tcomodines *c;
+    char *p;
+    int inicio = args->n;
+
+    if (strlen(patron) >= PATH_MAX) return 0;
+    if (bytes_glob > LIMITE_GLOB) vaciar_glob();
+    expansion_glob++;
+    c = (tcomodines *)malloc(sizeof(tcomodines));
+    c->arena = arena;
+    c->args = args;
+    c->ncomps = 0;
+    // Componentes partidos en una copia, si no casa nada la palabra tiene que quedar entera. Una / al principio deja un
+    // componente vacío, que al añadirse al camino es la raíz
+    p = arena_strdup(arena, patron);
+    c->comps[c->ncomps++] = p;
+    while ((p = strchr(p, '/')) != NULL) {
+        *p++ = '\0';
+        c->comps[c->ncomps++] = p;
+    }
+    c->ruta[0] = '\0';
+    buscar_comodines(c, 0, 0);
+    // Cada directorio sale ordenado, pero con varios niveles (o con **) el orden de los caminos enteros puede ser otro
+    if (c->ncomps > 1 && args->n - inicio > 1) qsort(args->v + inicio, args->n - inicio, sizeof(char *), comparar_cadenas);
+    free(c);
+    return args->n - inicio;
+}
+
+// Buscar el componente i del patrón en el directorio c->ruta (los n primeros bytes) y seguir con el resto en lo que case
+void buscar_comodines(tcomodines *c, size_t n, int i) {
+    char *comp = c->comps[i];
+    int ultimo = i == c->ncomps - 1;
+    size_t largo, prefijo, ini, fin, mitad;
+    dir_glob *d;
+    tentrada_dir *e;
+    struct stat st;
+
+    if (!es_patron(comp)) {
+        // Sin comodines no hace falta listar el directorio, el nombre se añade al camino y se comprueba que exista al final
+        largo = strlen(comp);
+        if (n + largo + 2 > PATH_MAX) return;
+        memcpy(c->ruta + n, comp, largo);
+        c->ruta[n + largo] = '\0';
+        if (!ultimo) {
+            c->ruta[n + largo] = '/';
+            buscar_comodines(c, n + largo + 1, i + 1);
+        } else if (lstat(c->ruta, &st) == 0) {
+            anadir_camino(c, n + largo, "");
         }
-        // Cambiar la máscara
-        umask_val = mascara;
         return;
     }
-    // Si no se ha pasado un argumento, se muestra la máscara actual
-    printf("%04o\n", umask_val);
+    c->ruta[n] = '\0';
+    d = listar_dir(n == 0 ? "." : c->ruta);
+    if (d == NULL) return;
+
+    if (strcmp(comp, "**") == 0) {
+        // Al final del patrón, el caso de cero directorios es el propio directorio con su /: a/** da a/ y todo lo que
+        // hay debajo, como bash con globstar. Un ** solo no tiene directorio que dar
+        if (ultimo && n > 0) anadir_camino(c, n, "");
+        buscar_globstar(c, n, i);
+        return;
+    }
+
+    // Las entradas están ordenadas: con un principio sin comodines, como en f12*.log, solo se miran las que empiezan por él
+    ini = 0;
+    fin = d->num;
+    prefijo = strcspn(comp, "*?[\\");
+    if (prefijo > 0) {
+        while (ini < fin) {
+            mitad = (ini + fin) / 2;
+            if (strncmp(d->entradas[mitad].nombre, comp, prefijo) < 0) ini = mitad + 1;
+            else fin = mitad;
+        }
+        fin = d->num;
+    }
+    for (e = d->entradas + ini; e < d->entradas + fin; e++) {
+        if (prefijo > 0 && strncmp(e->nombre, comp, prefijo) != 0) break;
+        if (fnmatch(comp, e->nombre, FNM_PERIOD) != 0) continue;  // FNM_PERIOD: los ocultos solo si el patrón empieza por .
+        if (ultimo) {
+            anadir_camino(c, n, e->nombre);
+            continue;
+        }
+        largo = strlen(e->nombre);
+        if (n + largo + 2 > PATH_MAX || !es_directorio(c, n, e, 1)) continue;
+        memcpy(c->ruta + n, e->nombre, largo);
+        c->ruta[n + largo] = '/';
+        buscar_comodines(c, n + largo + 1, i + 1);
+    }
 }
 
-// Implementación exit
-void salir() {
-    int i;
-    // Liberar memoria y matar los procesos en background
-    for (i = 0; i < num_procesos; i++) {
-        kill(pids[i], SIGKILL);
-        free(nombre_procesos[i]);
+// ** (el componente i) en el directorio c->ruta, cero o más directorios: el resto del patrón aquí y en cada subdirectorio,
+// sin seguir enlaces ni entrar en los ocultos. Al final del patrón, todo lo que hay por debajo
+void buscar_globstar(tcomodines *c, size_t n, int i) {
+    int ultimo = i == c->ncomps - 1;
+    size_t largo;
+    dir_glob *d;
+    tentrada_dir *e;
+
+    if (!ultimo) buscar_comodines(c, n, i + 1);
+    c->ruta[n] = '\0';
+    d = listar_dir(n == 0 ? "." : c->ruta);
+    if (d == NULL) return;
+    for (e = d->entradas; e < d->entradas + d->num; e++) {
+        if (e->nombre[0] == '.') continue;
+        if (ultimo) anadir_camino(c, n, e->nombre);
+        largo = strlen(e->nombre);
+        if (n + largo + 2 > PATH_MAX || !es_directorio(c, n, e, 0)) continue;
+        memcpy(c->ruta + n, e->nombre, largo);
+        c->ruta[n + largo] = '/';
+        buscar_globstar(c, n + largo + 1, i);
     }
-    free(pids);
-    free(nombre_procesos);
-    system("clear");
-    printf("\033[0;31m------- Asesinando la minishell ---------\x1b[0m\n");
-    printf("\033[0;32m----------- Hasta la próxima ------------\x1b[0m\n");
-    // Salir
-    exit(EXIT_SUCCESS);
 }
 
-// Implementación help
-void help() {
-    printf("\x1b[35m------- Minishell - Santiago Arias ------\n");
-    printf("\x1b[35m----------------- Ayuda -----------------\x1b[0m\n");
-    printf("Comandos internos:\n");
-    printf("cd [dir] - Cambia el directorio actual a dir. Sin especificar dir, se cambia al directorio HOME.\n");
-    printf("jobs - Muestra los procesos en segundo plano.\n");
-    printf("fg [pid] - Pone el proceso con el pid indicado en primer plano, o el último proceso mandado a segundo plano si no se da un argumento.\n");
-    printf("umask [mask] - Cambia la máscara de permisos de los archivos creados por la minishell, o imprimir la actual.\n");
-    printf("exit - Cierra la minishell.\n");
-    printf("clear - Limpia la pantalla.\n");
-    printf("help - Muestra esta ayuda.\n");
-    printf("El resto de comandos se ejecutan como en cualquier shell UNIX.\n");
+// Copiar a la arena el camino de los n primeros bytes de c->ruta más el nombre, y añadirlo a los argumentos
+void anadir_camino(tcomodines *c, size_t n, char *nombre) {
+    size_t largo = strlen(nombre);
+    char *camino = arena_alloc(c->arena, n + largo + 1);
+    memcpy(camino, c->ruta, n);
+    memcpy(camino + n, nombre, largo + 1);
+    anadir_arg(c->args, camino);
 }
 
-// Ejecutar mandatos externos
-void ejecutar_externo(tline *linea) {
-    int j;
-    int k;
-    pid_t pid;
-    int fd[2];
-    int redirent, redirsal, redirerr;
-    int status;
-    char *lineaenviada;
-    redirent = ficheroredireccion(linea, 1);
-    if (redirent == 1)  return;  // Si el fichero de redirección proporcionado es inválido, podemos salir directamente
-    redirsal = ficheroredireccion(linea, 2);
-    if (redirsal == 1) return;
-    redirerr = ficheroredireccion(linea, 3);
-    if (redirerr == 1) return;
-    lineaenviada = (char *)calloc(1024, sizeof(char)); // Uso calloc porque sino la línea en jobs aparecía con caracteres raros que venían de que malloc da la memoria sin ponerla a 0, calloc nos da el bloque bien limpio
-    // Comprobar si necesitamos pipes
-    if (linea->ncommands > 1) {
-        if (pipe(fd) != 0) {
-            fprintf(stderr, "%s. Error al crear el pipe, %s", linea->commands[0].argv[0], strerror(errno));
-            free(lineaenviada);
-            return;
+// La entrada es un directorio, con d_type si lo hay y si no con un stat. seguir: cuenta un enlace a un directorio
+int es_directorio(tcomodines *c, size_t n, tentrada_dir *e, int seguir) {
+    struct stat st;
+    int r;
+    if (e->tipo == DT_DIR) return 1;
+    if (e->tipo != DT_UNKNOWN && (e->tipo != DT_LNK || !seguir)) return 0;
+    strcpy(c->ruta + n, e->nombre);
+    r = seguir ? stat(c->ruta, &st) : lstat(c->ruta, &st);
+    return r == 0 && S_ISDIR(st.st_mode);
+}
+
+// Listado del directorio, de la caché si su mtime no ha cambiado y si no leyéndolo. NULL si no es un directorio o no se puede leer
+dir_glob *listar_dir(char *ruta) {
+    struct stat st;
+    struct timespec ahora;
+    dir_glob *d;
+    unsigned int h;
+    int fd;
+
+    if (stat(ruta, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+    h = (st.st_dev * 31 + st.st_ino) % TAM_GLOB;
+    for (d = tabla_glob[h]; d != NULL && (d->dev != st.st_dev || d->ino != st.st_ino); d = d->sig);
+    if (d != NULL && (d->expansion == expansion_glob ||
+        (d->fiable && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+        glob_aciertos++;
+        d->expansion = expansion_glob;
+        return d;
+    }
+    glob_fallos++;
+    fd = open(ruta, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    if (d == NULL) {
+        d = (dir_glob *)calloc(1, sizeof(dir_glob));
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+        d->sig = tabla_glob[h];
+        tabla_glob[h] = d;
+    }
+    clock_gettime(CLOCK_REALTIME, &ahora);
+    d->mtime = st.st_mtim;
+    d->fiable = (ahora.tv_sec - st.st_mtim.tv_sec) * 1000000000LL + ahora.tv_nsec - st.st_mtim.tv_nsec >= MARGEN_MTIME;
+    d->expansion = expansion_glob;
+    leer_dir(d, fd);
+    close(fd);
+    return d;
+}
+
+// Leer todas las entradas con getdents64 en d->buf, que crece al doble, y ordenarlas. Sin readdir no hay un DIR ni
+// una copia de cada entrada, los nombres se quedan donde los deja el kernel
+void leer_dir(dir_glob *d, int fd) {
+    size_t n = 0, tam_antes = d->tam + d->num * sizeof(tentrada_dir), pos;
+    ssize_t leidos;
+    struct dirent64 *de;
+    int num = 0;
+
+    while (1) {
+        if (d->tam - n < 32768) reservar(&d->buf, &d->tam, n + 32768);
+        leidos = getdents64(fd, d->buf + n, d->tam - n);
+        if (leidos == -1 && errno == EINTR) continue;
+        if (leidos <= 0) break;
+        n += leidos;
+    }
+    // Una entrada por registro como mucho, un registro tiene al menos la cabecera y un byte de nombre
+    d->entradas = (tentrada_dir *)realloc(d->entradas, (n / (offsetof(struct dirent64, d_name) + 1) + 1) * sizeof(tentrada_dir));
+    for (pos = 0; pos < n; pos += de->d_reclen) {
+        de = (struct dirent64 *)(d->buf + pos);
+        if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0'))) continue;
+        d->entradas[num].nombre = de->d_name;
+        d->entradas[num].tipo = de->d_type;
+        num++;
+    }
+    d->num = num;
+    qsort(d->entradas, num, sizeof(tentrada_dir), comparar_entradas);
+    bytes_glob += d->tam + num * sizeof(tentrada_dir) - tam_antes;
+}
+
+int comparar_entradas(const void *a, const void *b) {
+    return strcmp(((tentrada_dir *)a)->nombre, ((tentrada_dir *)b)->nombre);
+}
+
+int comparar_cadenas(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+void vaciar_glob() {
+    int i;
+    dir_glob *d, *sig;
+    for (i = 0; i < TAM_GLOB; i++) {
+        for (d = tabla_glob[i]; d != NULL; d = sig) {
+            sig = d->sig;
+            free(d->buf);
+            free(d->entradas);
+            free(d);
         }
+        tabla_glob[i] = NULL;
     }
+    bytes_glob = 0;
+}
 
-    // Ejecutar en foreground o background lo haremos desde el padre
-    pid = fork();
-    if (pid == -1) {
-        fprintf(stderr, "%s: Error al crear el proceso hijo, %s\n", linea->commands[0].argv[0], strerror(errno));
-        return;
+// Devolver la siguiente línea sin el \n, o NULL si ya no hay más. Lee por bloques y el buffer crece al doble si la línea no cabe.
+// La línea devuelta vale hasta la siguiente llamada
+char *siguiente_linea(tlector *l) {
+    char *nl, *linea;
+    ssize_t n;
+
+    while (1) {
+        nl = l->fin > l->ini ? memchr(l->buf + l->ini, '\n', l->fin - l->ini) : NULL;  // Antes de la primera lectura buf es NULL
+        if (nl != NULL) {
+            *nl = '\0';
+            linea = l->buf + l->ini;
+            l->ini = nl - l->buf + 1;
+            return linea;
+        }
+        if (l->fd == -1) break;  // Cadena de -c, no hay más que leer
+        // Mover lo que queda al principio y hacer sitio para leer, siempre queda un byte para el \0 final
+        if (l->ini > 0) {
+            memmove(l->buf, l->buf + l->ini, l->fin - l->ini);
+            l->fin -= l->ini;
+            l->ini = 0;
+        }
+        if (l->fin + 1 >= l->tam) {
+            l->tam = l->tam == 0 ? 65536 : l->tam * 2;
+            l->buf = (char *)realloc(l->buf, l->tam);
+        }
+        n = read(l->fd, l->buf + l->fin, l->tam - l->fin - 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        l->fin += n;
     }
-    if (pid == 0) {
-        umask(umask_val);  // Cambiar la máscara de permisos
-        if (linea->redirect_input != NULL) dup2(redirent, STDIN_FILENO);
-        if (linea->ncommands > 1) {
-            if (dup2(fd[1], STDOUT_FILENO) < 0) {
-                fprintf(stderr, "%s: Error al escribir en el pipe, %s\n", linea->commands[0].argv[0], strerror(errno));
-                free(lineaenviada);
-                exit(EXIT_FAILURE);
+    if (l->ini == l->fin) return NULL;
+    // Última línea sin \n
+    l->buf[l->fin] = '\0';
+    linea = l->buf + l->ini;
+    l->ini = l->fin;
+    return linea;
+}
+
+// Editor de línea: leer una línea del terminal en modo raw, con las flechas para moverse por ella y por la historia, CTRL + R
+// para buscar hacia atrás en la historia, CTRL + A/E al principio y al final, CTRL + U para borrar hasta el principio y CTRL + C
+// para descartarla. Devuelve NULL con CTRL + D en una línea vacía o al final de la entrada. La línea vale hasta la siguiente llamada
+char *editar_linea() {
+    struct termios raw;
+    int c, pos = -1, num = 0, buscando = 0, encontrada = -1, pendiente = 0;
+    char *guardada = NULL, *texto, busqueda[256];
+    size_t largo, tam_guardada = 0, largo_guardada = 0, largo_busqueda = 0, n;
+
+    raw = termios_original;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);  // Sin ISIG, CTRL + C y CTRL + Z llegan como teclas
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    edicion.largo = edicion.cursor = 0;
+    reservar(&edicion.buf, &edicion.tam, 1);
+    fflush(stdout);
+    while (1) {
+        c = leer_tecla();
+        if (c == -1 || (c == CTRL('D') && edicion.largo == 0 && !buscando)) break;
+        if (buscando) {
+            if (c == CTRL('R')) {
+                if (encontrada > 0) encontrada = buscar_historia(busqueda, largo_busqueda, encontrada - 1);
+            } else if (c == 0x7f || c == CTRL('H')) {
+                if (largo_busqueda > 0) largo_busqueda--;
+                encontrada = buscar_historia(busqueda, largo_busqueda, num - 1);
+            } else if (c >= ' ' && largo_busqueda < sizeof(busqueda)) {
+                busqueda[largo_busqueda++] = c;
+                encontrada = buscar_historia(busqueda, largo_busqueda, encontrada >= 0 ? encontrada : num - 1);
+            } else {
+                // Cualquier otra tecla termina la búsqueda. CTRL + G y CTRL + C dejan la línea como estaba, el resto se quedan
+                // con la entrada encontrada y siguen como una tecla normal
+                buscando = 0;
+                if (c != CTRL('G') && c != CTRL('C') && encontrada >= 0) {
+                    texto = entrada_historia(encontrada, &largo);
+                    poner_linea(texto, largo);
+                }
+                redibujar();
+                if (c == CTRL('G') || c == CTRL('C')) continue;
             }
-// Cerrar los extremos del pipe, dup2 duplica el descriptor de fichero, se puede cerrar el extremo de escritura, en este punto tenemos dos descriptores de fichero "iguales"
-            close(fd[0]);
-            close(fd[1]);
-        }
-        if (linea->redirect_output != NULL && linea->ncommands == 1) dup2(redirsal, STDOUT_FILENO);
-        else if (linea->redirect_error != NULL && linea->ncommands == 1) dup2(redirerr, STDERR_FILENO);
-        execv(linea->commands[0].filename, linea->commands[0].argv);
-        if (strcmp(strerror(errno), "Bad address \0")) fprintf(stderr, "%s: No se encuentra el mandatao.\n", linea->commands[0].argv[0]); // En caso en que el mandato no exista
-        free(lineaenviada);
-        exit(EXIT_FAILURE);
-    } else {  // PEsto se produce antes del execv
-        if (linea->background) {
-            // Añadir el proceso a la lista de procesos, ejecución en background
-            pids = realloc(pids, (num_procesos + 1) * sizeof(pid_t));  // Añadir espacio para el nuevo proceso
-            pids[num_procesos] = pid;  // Guardar el pid del *primer* proceso
-            nombre_procesos = realloc(nombre_procesos, (num_procesos + 1) * sizeof(char *));  // Añadir espacio para el nuevo proceso
-            for (k = 0; k < linea->ncommands; k++) {
-                for (j = 0; j < linea->commands[k].argc; j++) {  // Guardar el nombre completo del proceso, para simular la salida de jobs
-                    strcat(lineaenviada, linea->commands[k].argv[j]);
-                    strcat(lineaenviada, " ");
+            if (buscando) {
+                mostrar_busqueda(busqueda, largo_busqueda, encontrada);
+                continue;
+            }
+        }
+        if (c == '\n' || c == '\r') break;
+        switch (c) {
+        case CTRL('C'):  // Descartar la línea
+            printf("^C\n");
+            edicion.largo = edicion.cursor = 0;
+            break;
+        case CTRL('D'):  // Con algo escrito, borrar el carácter del cursor
+            if (edicion.cursor == edicion.largo) continue;
+            for (n = edicion.cursor + 1; n < edicion.largo && (edicion.buf[n] & 0xc0) == 0x80; n++);
+            memmove(edicion.buf + edicion.cursor, edicion.buf + n, edicion.largo - n);
+            edicion.largo -= n - edicion.cursor;
+            break;
+        case 0x7f:  // Retroceso, el carácter de antes del cursor con todos sus bytes
+        case CTRL('H'):
+            if (edicion.cursor == 0) continue;
+            for (n = edicion.cursor - 1; n > 0 && (edicion.buf[n] & 0xc0) == 0x80; n--);
+            memmove(edicion.buf + n, edicion.buf + edicion.cursor, edicion.largo - edicion.cursor);
+            edicion.largo -= edicion.cursor - n;
+            edicion.cursor = n;
+            break;
+        case CTRL('A'):
+            edicion.cursor = 0;
+            break;
+        case CTRL('E'):
+            edicion.cursor = edicion.largo;
+            break;
+        case CTRL('U'):
+            memmove(edicion.buf, edicion.buf + edicion.cursor, edicion.largo - edicion.cursor);
+            edicion.largo -= edicion.cursor;
+            edicion.cursor = 0;
+            break;
+        case CTRL('R'):
+            if (pos == -1) pos = num = sincronizar_historia();
+            buscando = 1;
+            encontrada = -1;
+            largo_busqueda = 0;
+            mostrar_busqueda(busqueda, 0, -1);
+            continue;
+        case 0x1b:  // Secuencias de escape: ESC [ o ESC O y la letra, o ESC [ número ~
+            c = leer_tecla();
+            if (c != '[' && c != 'O') continue;
+            c = leer_tecla();
+            if (c >= '0' && c <= '9') {
+                n = c;
+                while (c >= '0' && c <= '9') c = leer_tecla();
+                if (c == '~' && n == '3' && edicion.cursor < edicion.largo) {  // Suprimir
+                    for (n = edicion.cursor + 1; n < edicion.largo && (edicion.buf[n] & 0xc0) == 0x80; n++);
+                    memmove(edicion.buf + edicion.cursor, edicion.buf + n, edicion.largo - n);
+                    edicion.largo -= n - edicion.cursor;
                 }
-                if (k != linea->ncommands - 1) strcat(lineaenviada, "| ");
+                break;
             }
-            nombre_procesos[num_procesos] = (char*)malloc(1024 * sizeof(char));  // Añadir espacio para el nombre del proceso, para poder actualizarlos luego, se utiliza el valor 1024
-            strcpy(nombre_procesos[num_procesos], lineaenviada);
-            num_procesos++;
-            printf("[%d] %d\n", num_procesos, pid);  // Lo mismo que hace una shell de UNIX cuando se manda un mandato a background
-        } else {
-            // Ejecución en foreground
-            pidfg = pid; // Meter el pid en el activo para que lo mate el manejador si se le llama
-            signal(SIGINT, manejador_sigint); // Cambiar el manejador para poder matarlo con ctrl + c
-            if (linea->ncommands > 1 ) waitpid(pid, &status, WNOHANG);  // Si hay pipes, no esperamos a que se ejecute aquí, tendríamos problemas con mandatos del tipo "find / | grep santi", el grep no se ejecutaría hasta que se hiciera CTRL + C o terminase find
-            else waitpid(pid, &status, 0);  // Si es un solo mandato, esperamos a que se ejecute aquí
-            // Comprobar si el proceso hijo ha terminado correctamente
-            if (WIFEXITED(status) != 0)
-                if (WEXITSTATUS(status) != 0) fprintf(stderr, "%s: Error al ejecutar el mandato.\n", linea->commands[0].argv[0]);
+            if (c == 'A' || c == 'B') {
+                // Historia: pos es la entrada que se está viendo, num (la línea nueva) al principio. La línea que se estaba
+                // escribiendo se guarda al subir y vuelve al bajar hasta ella
+                if (pos == -1) pos = num = sincronizar_historia();
+                if (c == 'A' && pos == 0) continue;
+                if (c == 'B' && pos == num) continue;
+                if (pos == num) {
+                    reservar(&guardada, &tam_guardada, edicion.largo + 1);
+                    memcpy(guardada, edicion.buf, edicion.largo);
+                    largo_guardada = edicion.largo;
+                }
+                pos += c == 'A' ? -1 : 1;
+                if (pos == num) poner_linea(guardada, largo_guardada);
+                else {
+                    texto = entrada_historia(pos, &largo);
+                    poner_linea(texto, largo);
+                }
+            } else if (c == 'C') {
+                if (edicion.cursor < edicion.largo)
+                    for (edicion.cursor++; edicion.cursor < edicion.largo && (edicion.buf[edicion.cursor] & 0xc0) == 0x80; edicion.cursor++);
+            } else if (c == 'D') {
+                if (edicion.cursor > 0)
+                    for (edicion.cursor--; edicion.cursor > 0 && (edicion.buf[edicion.cursor] & 0xc0) == 0x80; edicion.cursor--);
+            } else if (c == 'H') {
+                edicion.cursor = 0;
+            } else if (c == 'F') {
+                edicion.cursor = edicion.largo;
+            }
+            break;
+        default:
+            if (c < ' ' && c != '\t') continue;  // Otras teclas de control no hacen nada
+            reservar(&edicion.buf, &edicion.tam, edicion.largo + 2);
+            memmove(edicion.buf + edicion.cursor + 1, edicion.buf + edicion.cursor, edicion.largo - edicion.cursor);
+            edicion.buf[edicion.cursor++] = c;
+            edicion.largo++;
+            // Lo normal es escribir al final: basta con sacar el byte, si la pantalla está al día
+            if (edicion.cursor == edicion.largo && !pendiente) {
+                putchar(c);
+                if (entrada.ini == entrada.fin) fflush(stdout);
+                continue;
+            }
+            break;
+        }
+        // Con más bytes ya leídos (un texto pegado) se redibuja una sola vez al final
+        pendiente = 1;
+        if (entrada.ini == entrada.fin) {
+            redibujar();
+            pendiente = 0;
         }
     }
+    if (pendiente) redibujar();
+    if (buscando && encontrada >= 0) {  // Intro en la búsqueda ejecuta la entrada encontrada
+        texto = entrada_historia(encontrada, &largo);
+        poner_linea(texto, largo);
+        redibujar();
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &termios_original);
+    free(guardada);
+    if (c == -1 && edicion.largo == 0) return NULL;
+    if (c == CTRL('D')) {
+        putchar('\n');
+        return NULL;
+    }
+    putchar('\n');
+    fflush(stdout);
+    edicion.buf[edicion.largo] = '\0';
+    return edicion.buf;
+}
 
-    // Proceso principal, en caso que haya pipes, mandamos la entrada de lectura del pipe, se produce después del execv
-    if (linea->ncommands > 1) {
-        // Todos los procesos tienen acceso independiente a los descriptores de fichero, luego también es necesario cerrar
-        // el extremo de escritura aquí para que el siguiente mandato sepa dónde termina la entrada estándar
-        close(fd[1]); // Cerramos este bicho aquí para que el hijo que creamos sepa dónde termina la entrada estándar
-        ejecutar_pipe(linea, linea->ncommands - 1, fd[0]); // Solo nos hace falta enviar el extremo de lectura del pipe
-        close(fd[0]);
+// Siguiente byte del terminal, esperando a que haya alguno (y avisando de los jobs que terminen) si no queda ninguno leído.
+// -1 al final de la entrada
+int leer_tecla() {
+    ssize_t n;
+    while (entrada.ini == entrada.fin) {
+        if (entrada.tam == 0) {
+            entrada.tam = 65536;
+            entrada.buf = (char *)malloc(entrada.tam);
+        }
+        entrada.ini = entrada.fin = 0;
+        editando = 1;
+        esperar_entrada();
+        editando = 0;
+        n = read(entrada.fd, entrada.buf, entrada.tam - 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        entrada.fin = n;
     }
-    // Liberar la memoria reservada
-    free(lineaenviada);
+    return (unsigned char)entrada.buf[entrada.ini++];
 }
 
-void ejecutar_pipe(tline *linea, int restantes, int entrada) { // Una forma recursiva, relativamente elegante, de gestionar las líneas que tengan pipes
-    // int entrada representa lo que es nuestra entrada estándar para X mandato, luego es el equivalente a tener "fd[0]", tendremos que cerrarlo igualmente
-    int fd[2];
-    pid_t pid;
-    int redirsal, redirerr;
-    if (restantes != 1) 
-        if (pipe(fd) != 0) {
-            fprintf(stderr, "%s: Error al crear el pipe: %s\n", linea->commands[linea->ncommands - restantes].argv[0], strerror(errno));
-            return;
+// Volver a sacar el prompt y la línea, con el cursor donde está (contando caracteres, no bytes)
+void redibujar() {
+    size_t i, detras = 0;
+    printf("\r");
+    prompt();
+    fwrite(edicion.buf, 1, edicion.largo, stdout);
+    printf("\x1b[K");
+    for (i = edicion.cursor; i < edicion.largo; i++)
+        if ((edicion.buf[i] & 0xc0) != 0x80) detras++;
+    if (detras > 0) printf("\x1b[%zuD", detras);
+    fflush(stdout);
+}
+
+void mostrar_busqueda(char *texto, size_t largo, int encontrada) {
+    char *entrada;
+    size_t largo_entrada = 0;
+    entrada = encontrada >= 0 ? entrada_historia(encontrada, &largo_entrada) : "";
+    printf("\r(%s)`%.*s': %.*s\x1b[K", encontrada >= 0 || largo == 0 ? "búsqueda" : "búsqueda fallida", (int)largo, texto, (int)largo_entrada, entrada);
+    fflush(stdout);
+}
+
+void poner_linea(char *texto, size_t largo) {
+    reservar(&edicion.buf, &edicion.tam, largo + 1);
+    memcpy(edicion.buf, texto, largo);
+    edicion.largo = edicion.cursor = largo;
+}
+
+// Abrir (o crear) la historia y proyectarla entera. No se lee nada, así el arranque no depende de su tamaño
+void abrir_historia() {
+    char ruta[PATH_MAX];
+    struct stat st;
+    if (valor_variable("HOME") == NULL) return;
+    snprintf(ruta, sizeof(ruta), "%s/.myshell_history", valor_variable("HOME"));
+    fd_historia = open(ruta, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_historia == -1) return;
+    if (fstat(fd_historia, &st) == 0 && st.st_size > 0) {
+        mapa_historia = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd_historia, 0);
+        if (mapa_historia == MAP_FAILED) mapa_historia = NULL;
+        else tam_mapa = st.st_size;
+    }
+}
+
+// Ampliar la proyección con lo que se haya añadido al fichero (también otras sesiones) e indexar las líneas nuevas.
+// Solo se indexan las líneas completas. Devuelve el número de entradas
+int sincronizar_historia() {
+    struct stat st;
+    char *p, *fin, *nl, *nuevo;
+
+    if (fd_historia == -1) return 0;
+    if (fstat(fd_historia, &st) == 0 && (size_t)st.st_size > tam_mapa) {
+        if (mapa_historia == NULL) nuevo = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd_historia, 0);
+        else nuevo = mremap(mapa_historia, tam_mapa, st.st_size, MREMAP_MAYMOVE);
+        if (nuevo != MAP_FAILED) {
+            mapa_historia = nuevo;
+            tam_mapa = st.st_size;
         }
-    pid = fork();
-    if (pid == -1) {
-        fprintf(stderr, "%s: Error al crear el proceso hijo: %s\n", linea->commands[linea->ncommands - restantes].argv[0], strerror(errno));
-        exit(EXIT_FAILURE);
-    } else if (pid == 0) {
-        umask(umask_val); // Aplicar la máscara de permisos de la minishell
-        if (dup2(entrada, STDIN_FILENO) < 0) {  // Redirigir la entrada estándar
-            fprintf(stderr, "%s: Error al leer del pipe, %s\n", linea->commands[linea->ncommands - restantes].filename, strerror(errno)); // Duplicar el descriptor de fichero de entrada estándar
-            exit(EXIT_FAILURE);
+    }
+    if (mapa_historia == NULL) return 0;
+    if (lineas_historia == NULL) {
+        max_historia = tam_mapa / 32 + 1024;  // Para no doblar muchas veces la primera vez con una historia grande
+        lineas_historia = (size_t *)malloc((max_historia + 1) * sizeof(size_t));
+        lineas_historia[0] = 0;
+    }
+    fin = mapa_historia + tam_mapa;
+    for (p = mapa_historia + lineas_historia[num_historia]; (nl = memchr(p, '\n', fin - p)) != NULL; p = nl + 1) {
+        if (num_historia == max_historia) {
+            max_historia *= 2;
+            lineas_historia = (size_t *)realloc(lineas_historia, (max_historia + 1) * sizeof(size_t));
         }
-        close(entrada);
-        if (restantes == 1) { // Si tenemos alguna redirección, hacemos dup2 aquí que es el último mandato de los enviados
-            redirsal = ficheroredireccion(linea, 2); // Ya comprobamos en ejecutar_interno si era un fichero válido
-            redirerr = ficheroredireccion(linea, 3);
-            if (linea->redirect_output != NULL) dup2(redirsal, STDOUT_FILENO);
-            else if (linea->redirect_error != NULL) dup2(redirerr, STDERR_FILENO);
-        } else { // Si no es el último mandato, seguiremos la recursión volviendo a redirigir la salida
-            if (dup2(fd[1], STDOUT_FILENO) < 0) {  // Redirigir la salida estándar de un posible mandato intermedio
-                fprintf(stderr, "%s: Error al escribir en el pipe, %s\n", linea->commands[linea->ncommands - restantes].filename, strerror(errno)); // Duplicar el descriptor de fichero de salida estándar
-                exit(EXIT_FAILURE);
-            }
-            close(fd[0]);
-            close(fd[1]);
+        lineas_historia[++num_historia] = nl + 1 - mapa_historia;
+    }
+    return num_historia;
+}
+
+// Texto de la entrada i (desde 0), sin el \n
+char *entrada_historia(int i, size_t *largo) {
+    *largo = lineas_historia[i + 1] - lineas_historia[i] - 1;
+    return mapa_historia + lineas_historia[i];
+}
+
+// Añadir la línea al final del fichero con una sola escritura, la proyección la recoge la próxima vez que se sincronice
+void anadir_historia(char *linea) {
+    struct iovec partes[2];
+    if (fd_historia == -1) return;
+    partes[0].iov_base = linea;
+    partes[0].iov_len = strlen(linea);
+    partes[1].iov_base = "\n";
+    partes[1].iov_len = 1;
+    if (writev(fd_historia, partes, 2) == -1) {
+        fprintf(stderr, "history: Error al escribir la historia, %s\n", strerror(errno));
+        close(fd_historia);
+        fd_historia = -1;
+    }
+}
+
+// Cambiar !! por la última entrada de la historia, !n por la n y !-n por la n-ésima empezando por el final, como en bash.
+// Un ! que no va seguido de ! ni de un número se deja como está. Devuelve la línea (en la arena si ha cambiado), que se
+// muestra como en bash, o NULL si alguna entrada no existe
+char *expandir_historia(char *linea) {
+    char *p = linea, *q, *fin, *buf = NULL, *texto, *resultado;
+    size_t n = 0, tam = 0, largo;
+    long i;
+    int num;
+
+    while ((q = strchr(p, '!')) != NULL) {
+        if (q[1] == '!') {
+            i = -1;
+            fin = q + 2;
+        } else if (isdigit((unsigned char)q[1]) || (q[1] == '-' && isdigit((unsigned char)q[2]))) {
+            i = strtol(q + 1, &fin, 10);
+        } else {
+            // Se copia hasta el ! incluido y se sigue después
+            reservar(&buf, &tam, n + (q + 1 - p));
+            memcpy(buf + n, p, q + 1 - p);
+            n += q + 1 - p;
+            p = q + 1;
+            continue;
         }
-        execv(linea->commands[linea->ncommands - restantes].filename, linea->commands[linea->ncommands - restantes].argv);
-        exit(EXIT_FAILURE);
+        num = sincronizar_historia();
+        i = i > 0 ? i - 1 : num + i;
+        if (i < 0 || i >= num) {
+            fprintf(stderr, "%.*s: No existe en la historia.\n", (int)(fin - q), q);
+            free(buf);
+            return NULL;
+        }
+        texto = entrada_historia(i, &largo);
+        reservar(&buf, &tam, n + (q - p) + largo);
+        memcpy(buf + n, p, q - p);
+        n += q - p;
+        memcpy(buf + n, texto, largo);
+        n += largo;
+        p = fin;
+        linea = NULL;  // Ha cambiado
     }
-    // Si hubiera varios pipes, cargaríamos los mandatos de forma recursiva, enviando la salida de lectura de la tubería donde cargamos antes la salida estándar
-    if (restantes != 1) {
-        close(fd[1]);  // Cerramos la entrada de escritura aquí para que el siguiente hijo sepa dónde termina la entrada estándar, de forma análoga a la primera ejecución
-        ejecutar_pipe(linea, restantes - 1, fd[0]);  // Llamada recursiva, el último mandato no tomará esta rama
-        close(fd[0]);
+    if (linea != NULL) {
+        free(buf);
+        return linea;
     }
+    largo = strlen(p);
+    resultado = arena_alloc(&arena_linea, n + largo + 1);
+    memcpy(resultado, buf, n);
+    memcpy(resultado + n, p, largo + 1);
+    free(buf);
+    printf("%s\n", resultado);
+    return resultado;
+}
 
-    if (!linea->background) { // Ejecución en foreground
-        /* Esta espera se pone al final porque si tuviéramos una línea del tipo "find / | grep h | head -5", se quedaría esperando a la finalización de grep, se quedaría colgado como "find / | grep h" si esperasemos en vez de usar WNOHANG en ejecutar_externo el pidfg
-        esto se debe a que intentaríamos esperar por el mandato anterior, cuando es el último el que se debe estar ejecutando, sin que el anterior haya terminado necesariamente. El loop principal se encargará de escanear por procesos
-        zombies, luego en líneas como "find / | grep h | head -5", en las que find queda zombie porque se termina antes de sacar head que de buscar, lo limpiará el loop principal.*/
-        // Esperar por los PIDS empezando por el último y hasta el segundo, se espera por ellos, el primer mandato si queda zombie, lo limpia loop principal.
-        waitpid(pid, NULL, 0);
-        // No se queda esperando en líneas que tienen mandatos como "grep" entre medias, porque tienen las entradas y salidas redirigidas, y el descriptor de fichero de entrada cerrado cuando llega aquí, así que muere directamente al esperar por él
+// La entrada más reciente, empezando por desde, que contiene el texto. -1 si no hay ninguna
+int buscar_historia(char *texto, size_t largo, int desde) {
+    char *entrada;
+    size_t largo_entrada;
+    if (largo == 0) return -1;
+    for (; desde >= 0; desde--) {
+        entrada = entrada_historia(desde, &largo_entrada);
+        if (memmem(entrada, largo_entrada, texto, largo) != NULL) return desde;
     }
+    return -1;
 }
 
-int ficheroredireccion(tline *linea, int tipo) { // Separado del proceso de ejecución para poder redirigir la salida más fácilmente en el caso de las pipes
-    int redir = 0;
-    
-    if (linea->redirect_input != NULL && tipo == 1) redir = open(linea->redirect_input, O_RDONLY);
-    if (linea->redirect_output != NULL && tipo == 2) redir = creat(linea->redirect_output, 0666 - umask_val); // Usamos el valor de la máscara para creación de archivos de la minishell
-    if (linea->redirect_error != NULL && tipo == 3) redir = creat(linea->redirect_error, 0666 - umask_val);
-    if (redir == -1 && (linea->redirect_input != NULL || linea->redirect_output != NULL || linea->redirect_error != NULL)) {
-        fprintf(stderr, "%s: Error. No se pudo abrir o crear el archivo proporcionado, %s\n", linea->commands[0].argv[0], strerror(errno));
+// Poner al día el índice ordenado: las entradas nuevas se ordenan solas y se mezclan con las que ya estaban. Suele haber
+// pocas nuevas (las líneas escritas desde la última búsqueda): cada una busca su sitio con una búsqueda binaria y lo que
+// hay entre una y otra se copia de golpe, sin comparar entrada a entrada
+void ordenar_historia() {
+    int num, i, j, k, ini, fin, mitad, *mezcla;
+
+    num = sincronizar_historia();
+    if (num == num_ordenadas) return;
+    orden_historia = (int *)realloc(orden_historia, num * sizeof(int));
+    for (i = num_ordenadas; i < num; i++) orden_historia[i] = i;
+    qsort(orden_historia + num_ordenadas, num - num_ordenadas, sizeof(int), comparar_historia);
+    if (num_ordenadas > 0) {
+        mezcla = (int *)malloc(num * sizeof(int));
+        for (i = 0, k = 0, j = num_ordenadas; j < num; j++) {
+            ini = i;
+            fin = num_ordenadas;
+            while (ini < fin) {
+                mitad = (ini + fin) / 2;
+                if (comparar_historia(&orden_historia[mitad], &orden_historia[j]) < 0) ini = mitad + 1;
+                else fin = mitad;
+            }
+            memcpy(mezcla + k, orden_historia + i, (ini - i) * sizeof(int));
+            k += ini - i;
+            i = ini;
+            mezcla[k++] = orden_historia[j];
+        }
+        memcpy(mezcla + k, orden_historia + i, (num_ordenadas - i) * sizeof(int));
+        free(orden_historia);
+        orden_historia = mezcla;
+    }
+    num_ordenadas = num;
+}
+
+// Por el texto de las entradas, y las iguales por antigüedad
+int comparar_historia(const void *a, const void *b) {
+    char *ta, *tb;
+    size_t la, lb;
+    int r;
+    ta = entrada_historia(*(int *)a, &la);
+    tb = entrada_historia(*(int *)b, &lb);
+    r = memcmp(ta, tb, la < lb ? la : lb);
+    if (r != 0) return r;
+    if (la != lb) return la < lb ? -1 : 1;
+    return *(int *)a - *(int *)b;
+}
+
+int comparar_enteros(const void *a, const void *b) {
+    return *(int *)a - *(int *)b;
+}
+
+// Bloquear SIGCHLD y recibirlo por un signalfd, que se vigila con epoll junto a la entrada estándar
+void inicializar_jobs() {
+    sigset_t mascara;
+    struct epoll_event ev;
+
+    sigemptyset(&mascara);
+    sigaddset(&mascara, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mascara, &mascara_original);
+    fd_sigchld = signalfd(-1, &mascara, SFD_NONBLOCK | SFD_CLOEXEC);
+    fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd_sigchld;
+    epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_sigchld, &ev);
+    if (interactivo && entrada.fd == STDIN_FILENO) {
+        ev.data.fd = STDIN_FILENO;
+        entrada_en_epoll = epoll_ctl(fd_epoll, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+    }
+
+    // Los hijos no deben heredar SIGCHLD bloqueado
+    posix_spawnattr_init(&atributos_spawn);
+    posix_spawnattr_setsigmask(&atributos_spawn, &mascara_original);
+    posix_spawnattr_setflags(&atributos_spawn, POSIX_SPAWN_SETSIGMASK);
+}
+
+// Esperar a que haya una línea que leer, avisando en el momento de los jobs en background que terminen
+void esperar_entrada() {
+    struct epoll_event evs[2];
+    int i, n;
+
+    if (!entrada_en_epoll) return;
+    if (memchr(entrada.buf + entrada.ini, '\n', entrada.fin - entrada.ini) != NULL) return;  // Ya hay una línea leída en el buffer
+    fflush(stdout);
+    while (1) {
+        n = epoll_wait(fd_epoll, evs, 2, -1);
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.fd == STDIN_FILENO) return;
+            if (recoger_hijos(1) > 0) {  // Volver a sacar el prompt (y lo que se llevaba escrito) debajo del aviso
+                if (editando) redibujar();
+                else prompt();
+                fflush(stdout);
+            }
+        }
+    }
+}
+
+// Recoger todos los hijos que hayan terminado, un wait4 por hijo y la búsqueda de su job en la tabla de pids.
+// Avisa de los jobs en background que terminan, con un salto de línea antes si se está en el prompt. Devuelve cuántos ha avisado
+int recoger_hijos(int nueva_linea) {
+    struct signalfd_siginfo info;
+    proceso_job *proc;
+    pid_t pid;
+    int status, avisados = 0, i;
+    tjob *job;
+    struct rusage uso;
+
+    while (read(fd_sigchld, &info, sizeof(info)) > 0);  // Vaciar el signalfd, varios SIGCHLD pueden llegar como uno solo
+    while ((pid = wait4(-1, &status, WNOHANG, &uso)) > 0) {
+        if ((proc = quitar_proceso(pid)) == NULL) continue;  // No es de ningún job en background
+        job = proc->job;
+        marcar_terminado(job, proc->etapa, status, &uso);
+        free(proc);
+        if (job->vivos == 0 && job->id != 0) {  // Los que no tienen id son de parallel, que los libera él
+            if (nueva_linea && avisados == 0) printf("\n");
+            if (interactivo) notificar_job(job);  // En scripts no se avisa, como en bash
+            liberar_job(job);
+            avisados++;
+        }
+    }
+    for (i = 0; jobs_recogidos > 0 && i < max_jobs; i++) {  // Los que ya ha recogido esperar_job siguen en la tabla con vivos a 0
+        if (jobs_bg[i] == NULL || jobs_bg[i]->vivos > 0) continue;
+        if (nueva_linea && avisados == 0) printf("\n");
+        if (interactivo) notificar_job(jobs_bg[i]);
+        liberar_job(jobs_bg[i]);
+        jobs_recogidos--;
+        avisados++;
+    }
+    jobs_recogidos = 0;
+    return avisados;
+}
+
+// Crear un job para la línea, sin procesos todavía
+tjob *nuevo_job(tline *linea) {
+    tjob *job;
+    int i, j;
+    size_t tam = 1;
+    char *p;
+
+    job = (tjob *)calloc(1, sizeof(tjob));
+    job->nprocesos = linea->ncommands;
+    job->pids = (pid_t *)malloc(linea->ncommands * sizeof(pid_t));
+    job->estados = (int *)malloc(linea->ncommands * sizeof(int));
+    job->usos = (struct rusage *)calloc(linea->ncommands, sizeof(struct rusage));
+    job->lanzadas = (struct timespec *)calloc(linea->ncommands, sizeof(struct timespec));
+    job->terminadas = (struct timespec *)calloc(linea->ncommands, sizeof(struct timespec));
+    job->cpus = (cpu_set_t *)calloc(linea->ncommands, sizeof(cpu_set_t));
+    job->background = linea->background;
+    for (i = 0; i < linea->ncommands; i++) {
+        job->pids[i] = -1;
+        job->estados[i] = -1;
+        for (j = 0; j < linea->commands[i].argc; j++) tam += strlen(linea->commands[i].argv[j]) + 1;
+        tam += 2;
+    }
+    // Guardar el nombre completo del job, para simular la salida de jobs. Con stpcpy y no strcat, que con los miles de argumentos
+    // que puede dejar un $(...) recorrería el nombre entero en cada uno
+    job->nombre = (char *)malloc(tam);
+    p = job->nombre;
+    for (i = 0; i < linea->ncommands; i++) {
+        for (j = 0; j < linea->commands[i].argc; j++) {
+            p = stpcpy(p, linea->commands[i].argv[j]);
+            *p++ = ' ';
+        }
+        if (i != linea->ncommands - 1) p = stpcpy(p, "| ");
+    }
+    *p = '\0';
+    job->numero = ++jobs_creados;
+    clock_gettime(CLOCK_MONOTONIC, &job->inicio);
+    return job;
+}
+
+// Guardar el pid de una etapa, los de background también en la tabla de pids para que los encuentre recoger_hijos
+void anadir_proceso(tjob *job, int etapa, pid_t pid) {
+    proceso_job *proc;
+
+    job->pids[etapa] = pid;
+    if (pid == -1) {
+        job->estados[etapa] = 127 << 8;  // Como si el hijo hubiera salido con 127, mandato no encontrado
+        return;
+    }
+    job->vivos++;
+    if (!job->background) return;
+    proc = (proceso_job *)malloc(sizeof(proceso_job));
+    proc->pid = pid;
+    proc->job = job;
+    proc->etapa = etapa;
+    proc->sig = tabla_pids[pid % TAM_PIDS];
+    tabla_pids[pid % TAM_PIDS] = proc;
+}
+
+// Sacar un pid recogido de la tabla de pids, el que llama libera la entrada. NULL si no estaba
+proceso_job *quitar_proceso(pid_t pid) {
+    proceso_job **p, *proc;
+
+    for (p = &tabla_pids[pid % TAM_PIDS]; *p != NULL && (*p)->pid != pid; p = &(*p)->sig);
+    if (*p == NULL) return NULL;
+    proc = *p;
+    *p = proc->sig;
+    return proc;
+}
+
+void marcar_terminado(tjob *job, int etapa, int status, struct rusage *uso) {
+    job->estados[etapa] = status;
+    job->usos[etapa] = *uso;
+    TRAZAR(EV_EXIT, job->pids[etapa], job, etapa, status, (int)((uso->ru_utime.tv_sec + uso->ru_stime.tv_sec) * 1000000 + uso->ru_utime.tv_usec + uso->ru_stime.tv_usec), NULL);
+    clock_gettime(CLOCK_MONOTONIC, &job->terminadas[etapa]);
+    job->vivos--;
+    if (job->vivos == 0) job->fin = job->terminadas[etapa];
+}
+
+// Dar un id al job y meterlo en la tabla de background
+void registrar_job(tjob *job) {
+    int i;
+    if (num_ids_libres > 0) job->id = ids_libres[--num_ids_libres];
+    else {
+        if (num_jobs == max_jobs) {  // Crecer al doble, no un realloc por job
+            max_jobs = max_jobs == 0 ? 16 : max_jobs * 2;
+            jobs_bg = (tjob **)realloc(jobs_bg, max_jobs * sizeof(tjob *));
+            ids_libres = (int *)realloc(ids_libres, max_jobs * sizeof(int));
+            for (i = num_jobs; i < max_jobs; i++) jobs_bg[i] = NULL;
+        }
+        job->id = num_jobs + 1;  // Sin ids libres, los ids 1..num_jobs están todos ocupados
+    }
+    jobs_bg[job->id - 1] = job;
+    num_jobs++;
+    ultimo_job = job;
+}
+
+// Sacar el job de la tabla (si estaba) y liberarlo
+void liberar_job(tjob *job) {
+    int i;
+
+    TRAZAR(EV_JOB, pid_minishell, job, -1, job->estados[job->nprocesos - 1], 0, NULL);
+    if (job->id != 0) {
+        jobs_bg[job->id - 1] = NULL;
+        ids_libres[num_ids_libres++] = job->id;
+        num_jobs--;
+        if (num_jobs == 0) num_ids_libres = 0;  // Sin jobs se vuelve a empezar por el 1
+    }
+    if (ultimo_job == job) ultimo_job = NULL;
+    for (i = 0; i < job->nprocesos && job->vivos > 0; i++) {  // Solo quedan en la tabla de pids los que no se han recogido
+        if (job->pids[i] == -1 || job->estados[i] != -1 || !job->background) continue;
+        free(quitar_proceso(job->pids[i]));
+    }
+    free(job->nombre);
+    free(job->pids);
+    free(job->estados);
+    free(job->usos);
+    free(job->lanzadas);
+    free(job->terminadas);
+    free(job->cpus);
+    free(job);
+}
+
+// Esperar a que terminen todas las etapas de un job en foreground. Se recoge cada hijo según termina, no por orden
+// de etapa, para que el tiempo real y los recursos de cada etapa sean los suyos. Los de background que terminen
+// mientras tanto se marcan aquí y se avisa de ellos en recoger_hijos, antes del siguiente prompt
+void esperar_job(tjob *job) {
+    int i, status;
+    pid_t pid;
+    struct rusage uso;
+    proceso_job *proc;
+    job_fg = job; // Meter el job en el activo para que lo mate el manejador si se le llama
+    if (interactivo) signal(SIGINT, manejador_sigint); // Cambiar el manejador para poder matarlo con ctrl + c
+    while (job->vivos > 0) {
+        if ((pid = wait4(-1, &status, 0, &uso)) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (i = 0; i < job->nprocesos && (job->pids[i] != pid || job->estados[i] != -1); i++);
+        if (i < job->nprocesos) {
+            if (job->background) free(quitar_proceso(pid));  // Un job de background que se ha traído con fg
+            marcar_terminado(job, i, status, &uso);
+        } else if ((proc = quitar_proceso(pid)) != NULL) {
+            marcar_terminado(proc->job, proc->etapa, status, &uso);
+            if (proc->job->vivos == 0 && proc->job->id != 0) jobs_recogidos++;
+            free(proc);
+        }
+    }
+    job_fg = NULL;
+    if (interactivo) signal(SIGINT, SIG_IGN);
+}
+
+// Aviso de job terminado, como el de bash
+void notificar_job(tjob *job) {
+    int status = job->estados[job->nprocesos - 1];  // El status del job es el de la última etapa
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) printf("[%d] Done           %s\n", job->id, job->nombre);
+    else if (WIFEXITED(status)) printf("[%d] Exit %-10d%s\n", job->id, WEXITSTATUS(status), job->nombre);
+    else printf("[%d] %-14s %s\n", job->id, strsignal(WTERMSIG(status)), job->nombre);
+}
+
+// Línea de una etapa para time y jobs -l: tiempo real desde que se creó hasta que se recogió (o hasta ahora si sigue viva)
+// y, si ha terminado, la CPU de usuario y de sistema, la memoria máxima y los cambios de contexto voluntarios/involuntarios
+void informe_etapa(FILE *f, tjob *job, int etapa) {
+    struct timespec ahora;
+    struct rusage *uso = &job->usos[etapa];
+    char estado[16], cpus[64] = "";
+    int cpu;
+
+    if (job->pids[etapa] == -1) {
+        fprintf(f, "    %-2d %7s  No lanzada\n", etapa, "-");
+        return;
+    }
+    if (job->pids[etapa] == 0) {  // Mandato interno ejecutado en la minishell, no hay recursos propios
+        if (WEXITSTATUS(job->estados[etapa]) == 0) strcpy(estado, "Done");
+        else snprintf(estado, sizeof(estado), "Exit %d", WEXITSTATUS(job->estados[etapa]));
+        fprintf(f, "    %-2d %7s  %-10s  real %8.3fs\n", etapa, "interno", estado, segundos(&job->lanzadas[etapa], &job->terminadas[etapa]));
+        return;
+    }
+    // Dónde se dejó la etapa con sched y, si sigue viva, la CPU en la que está
+    if (CPU_COUNT(&job->cpus[etapa]) > 0) {
+        strcpy(cpus, "  cpus ");
+        formato_cpus(&job->cpus[etapa], cpus + 7, sizeof(cpus) - 7);
+    }
+    if (job->estados[etapa] == -1) {
+        clock_gettime(CLOCK_MONOTONIC, &ahora);
+        cpu = cpu_actual(job->pids[etapa]);
+        fprintf(f, "    %-2d %7d  Running     real %8.3fs%s", etapa, job->pids[etapa], segundos(&job->lanzadas[etapa], &ahora), cpus);
+        if (cpu != -1) fprintf(f, "  en %d", cpu);
+        fprintf(f, "\n");
+        return;
+    }
+    if (WIFEXITED(job->estados[etapa]) && WEXITSTATUS(job->estados[etapa]) == 0) strcpy(estado, "Done");
+    else if (WIFEXITED(job->estados[etapa])) snprintf(estado, sizeof(estado), "Exit %d", WEXITSTATUS(job->estados[etapa]));
+    else snprintf(estado, sizeof(estado), "Signal %d", WTERMSIG(job->estados[etapa]));
+    fprintf(f, "    %-2d %7d  %-10s  real %8.3fs  user %8.3fs  sys %8.3fs  maxrss %7ldK  csw %ld/%ld%s\n", etapa, job->pids[etapa],
+            estado,
+            segundos(&job->lanzadas[etapa], &job->terminadas[etapa]),
+            uso->ru_utime.tv_sec + uso->ru_utime.tv_usec / 1e6, uso->ru_stime.tv_sec + uso->ru_stime.tv_usec / 1e6,
+            uso->ru_maxrss, uso->ru_nvcsw, uso->ru_nivcsw, cpus);
+}
+
+// Informe de time para un job en foreground: una línea por etapa y el total, la CPU sumada de todas
+void informe_job(tjob *job) {
+    int i;
+    double user = 0, sys = 0;
+
+    fprintf(stderr, "    et     pid  estado\n");
+    for (i = 0; i < job->nprocesos; i++) {
+        informe_etapa(stderr, job, i);
+        user += job->usos[i].ru_utime.tv_sec + job->usos[i].ru_utime.tv_usec / 1e6;
+        sys += job->usos[i].ru_stime.tv_sec + job->usos[i].ru_stime.tv_usec / 1e6;
+    }
+    fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs\n", segundos(&job->inicio, &job->fin), user, sys);
+}
+
+double segundos(struct timespec *inicio, struct timespec *fin) {
+    return (fin->tv_sec - inicio->tv_sec) + (fin->tv_nsec - inicio->tv_nsec) / 1e9;
+}
+
+// Vaciar la tabla hash de mandatos, los directorios del PATH se vuelven a comprobar al buscar
+void vaciar_hash() {
+    int i;
+    entrada_hash *e, *sig;
+    for (i = 0; i < TAM_HASH; i++) {
+        for (e = tabla_hash[i]; e != NULL; e = sig) {
+            sig = e->sig;
+            free(e->nombre);
+            free(e->ruta);
+            free(e);
+        }
+        tabla_hash[i] = NULL;
+    }
+}
+
+// Partir el PATH en directorios, si ha cambiado desde la última vez se vacía la tabla
+void comprobar_path() {
+    char *path, *dir, *copia;
+    int i;
+
+    path = valor_variable("PATH");
+    if (path == NULL) path = "/bin:/usr/bin";   // El mismo valor por defecto que usaba libparser.a
+    if (path_guardado != NULL && strcmp(path, path_guardado) == 0) return;
+
+    vaciar_hash();
+    for (i = 0; i < num_dirs_path; i++) free(dirs_path[i].ruta);
+    free(path_guardado);
+    path_guardado = strdup(path);
+    num_dirs_path = 0;
+    dirs_path = (dir_path *)realloc(dirs_path, (strlen(path) / 2 + 2) * sizeof(dir_path)); // Nunca hay más directorios que la mitad de caracteres + 1
+    copia = strdup(path);
+    for (dir = strtok(copia, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+        dirs_path[num_dirs_path].ruta = strdup(dir);
+        dirs_path[num_dirs_path].validado = 0;  // 0 fuerza a que se haga el primer stat
+        memset(&dirs_path[num_dirs_path].mtime, 0, sizeof(struct timespec));
+        num_dirs_path++;
+    }
+    free(copia);
+}
+
+// Comprobar si el directorio i del PATH ha cambiado (mtime), como mucho un stat por directorio en cada línea. Devuelve 1 si ha cambiado
+int dir_modificado(int i) {
+    struct stat st;
+    int cambiado;
+    if (dirs_path[i].validado == num_linea) return 0;
+    if (stat(dirs_path[i].ruta, &st) != 0) memset(&st.st_mtim, 0, sizeof(struct timespec));
+    cambiado = dirs_path[i].validado != 0 && (st.st_mtim.tv_sec != dirs_path[i].mtime.tv_sec || st.st_mtim.tv_nsec != dirs_path[i].mtime.tv_nsec); // La primera vez solo se guarda
+    dirs_path[i].validado = num_linea;
+    dirs_path[i].mtime = st.st_mtim;
+    return cambiado;
+}
+
+unsigned int funcion_hash(char *s) {  // djb2
+    unsigned int h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h % TAM_HASH;
+}
+
+// Buscar la ruta absoluta de un mandato, primero en la tabla hash y si no está recorriendo el PATH. Devuelve NULL si no existe
+char *buscar_mandato(char *nombre) {
+    entrada_hash *e;
+    unsigned int h;
+    int i, cambiado;
+    char ruta[1024];
+
+    if (strchr(nombre, '/') != NULL) return access(nombre, X_OK) == 0 ? nombre : NULL; // Rutas explícitas, no se guardan
+    comprobar_path();
+    h = funcion_hash(nombre);
+    for (e = tabla_hash[h]; e != NULL; e = e->sig) {
+        if (strcmp(e->nombre, nombre) != 0) continue;
+        // La entrada deja de valer si cambia su directorio o uno anterior, en el que podría haber aparecido un mandato con el mismo nombre
+        cambiado = 0;
+        for (i = 0; i <= e->dir; i++) cambiado |= dir_modificado(i);
+        if (!cambiado) {
+            hash_aciertos++;
+            e->usos++;
+            return e->ruta;
+        }
+        vaciar_hash();
+        break;
+    }
+
+    hash_fallos++;
+    for (i = 0; i < num_dirs_path; i++) {
+        if (dir_modificado(i)) vaciar_hash(); // Lo que hubiera en la tabla puede haber quedado tapado por un mandato nuevo
+        snprintf(ruta, sizeof(ruta), "%s/%s", dirs_path[i].ruta, nombre);
+        if (access(ruta, X_OK) == 0) {
+            e = (entrada_hash *)malloc(sizeof(entrada_hash));
+            e->nombre = strdup(nombre);
+            e->ruta = strdup(ruta);
+            e->dir = i;
+            e->usos = 1;
+            e->sig = tabla_hash[h];
+            tabla_hash[h] = e;
+            return e->ruta;
+        }
+    }
+    return NULL;
+}
+
+// Buscar un mandato en un PATH que no es el de la minishell (PATH=... delante del mandato), sin la tabla hash, que es
+// solo del PATH de la minishell. Devuelve la ruta en la arena de la línea o NULL si no existe
+char *buscar_en_path(char *nombre, char *path) {
+    char ruta[1024];
+    size_t largo;
+
+    if (strchr(nombre, '/') != NULL) return access(nombre, X_OK) == 0 ? nombre : NULL;
+    for (; *path != '\0'; path += largo + (path[largo] == ':')) {
+        largo = strcspn(path, ":");
+        if (largo == 0) continue;  // Directorios vacíos fuera, como en comprobar_path
+        snprintf(ruta, sizeof(ruta), "%.*s/%s", (int)largo, path, nombre);
+        if (access(ruta, X_OK) == 0) return arena_strdup(&arena_linea, ruta);
+    }
+    return NULL;
+}
+
+// Resolver las rutas de los mandatos de la línea con la tabla hash, o con el PATH que lleven delante si lo cambian
+void resolver_mandatos(tline *linea) {
+    int i;
+    char *ruta, *path, **prefijo;
+    for (i = 0; i < linea->ncommands; i++) {
+        if (buscar_interno(linea->commands[i].argv[0]) != NULL) {  // Los internos no se buscan en el PATH, aunque haya un /bin/echo
+            linea->commands[i].filename = NULL;
+            continue;
+        }
+        path = NULL;
+        for (prefijo = prefijos_etapa(i); prefijo != NULL && *prefijo != NULL; prefijo++)
+            if (strncmp(*prefijo, "PATH=", 5) == 0) path = *prefijo + 5;  // Si hay varios vale el último
+        if (path != NULL) {
+            linea->commands[i].filename = buscar_en_path(linea->commands[i].argv[0], path);
+            continue;
+        }
+        ruta = buscar_mandato(linea->commands[i].argv[0]);
+        // Copia en la arena de la línea, la entrada de la tabla puede desaparecer si al buscar otra etapa cambia un directorio
+        if (ruta != NULL && ruta != linea->commands[i].argv[0]) ruta = arena_strdup(&arena_linea, ruta);
+        linea->commands[i].filename = ruta;
+    }
+}
+
+// Cargar las variables del entorno con el que arranca la minishell, todas exportadas
+void cargar_entorno() {
+    char **e, *igual;
+    for (e = environ; *e != NULL; e++) {
+        igual = strchr(*e, '=');
+        if (igual != NULL && igual > *e) asignar_variable(*e, igual - *e, igual + 1, 1);
+    }
+}
+
+// La misma djb2 que funcion_hash, sobre los largo primeros bytes: los nombres de $VAR no terminan en \0
+unsigned int hash_variable(char *nombre, size_t largo) {
+    unsigned int h = 5381;
+    size_t i;
+    for (i = 0; i < largo; i++) h = h * 33 + (unsigned char)nombre[i];
+    return h % TAM_HASH;
+}
+
+// Buscar una variable por su nombre (los largo primeros bytes), NULL si no existe
+tvariable *buscar_variable(char *nombre, size_t largo) {
+    tvariable *v;
+    for (v = tabla_variables[hash_variable(nombre, largo)]; v != NULL; v = v->sig)
+        if (v->largo_nombre == largo && memcmp(v->cadena, nombre, largo) == 0) return v;
+    return NULL;
+}
+
+char *valor_variable(char *nombre) {
+    tvariable *v = buscar_variable(nombre, strlen(nombre));
+    return v == NULL ? NULL : v->cadena + v->largo_nombre + 1;
+}
+
+// Dar valor a una variable, creándola si no existe. exportar: 1 la exporta, 0 deja de exportarla y -1 lo deja como estaba.
+// Si cambia el PATH se vacía la tabla de mandatos, sus rutas pueden haber dejado de valer
+void asignar_variable(char *nombre, size_t largo, char *valor, int exportar) {
+    tvariable *v = buscar_variable(nombre, largo);
+    size_t largo_valor = strlen(valor);
+    char *cadena;
+    unsigned int h;
+
+    cadena = (char *)malloc(largo + largo_valor + 2);
+    memcpy(cadena, nombre, largo);
+    cadena[largo] = '=';
+    memcpy(cadena + largo + 1, valor, largo_valor + 1);
+    if (v == NULL) {
+        h = hash_variable(nombre, largo);
+        v = (tvariable *)malloc(sizeof(tvariable));
+        v->largo_nombre = largo;
+        v->exportada = 0;
+        v->sig = tabla_variables[h];
+        tabla_variables[h] = v;
+    } else {
+        free(v->cadena);
+    }
+    v->cadena = cadena;
+    if (v->exportada || exportar == 1) envp_valido = 0;  // envp_cache apuntaba a la cadena anterior
+    if (exportar != -1) v->exportada = exportar;
+    if (largo == 4 && memcmp(nombre, "PATH", 4) == 0) vaciar_hash();
+}
+
+void borrar_variable(char *nombre, size_t largo) {
+    tvariable **p, *v;
+    for (p = &tabla_variables[hash_variable(nombre, largo)]; *p != NULL; p = &(*p)->sig) {
+        v = *p;
+        if (v->largo_nombre != largo || memcmp(v->cadena, nombre, largo) != 0) continue;
+        *p = v->sig;
+        if (v->exportada) envp_valido = 0;
+        free(v->cadena);
+        free(v);
+        if (largo == 4 && memcmp(nombre, "PATH", 4) == 0) vaciar_hash();
+        return;
+    }
+}
+
+// Si la palabra es una asignación (nombre=valor, con un nombre de letras, números y _ que no empieza por número), el largo del
+// nombre. Si no, 0
+int es_asignacion(char *palabra) {
+    char *p = palabra;
+    if (!isalpha((unsigned char)*p) && *p != '_') return 0;
+    while (isalnum((unsigned char)*p) || *p == '_') p++;
+    return *p == '=' ? p - palabra : 0;
+}
+
+// El entorno de los hijos, rehecho solo si ha cambiado alguna variable exportada desde la última vez
+char **entorno() {
+    tvariable *v;
+    int i, n = 0;
+
+    if (envp_valido) return envp_cache;
+    for (i = 0; i < TAM_HASH; i++)
+        for (v = tabla_variables[i]; v != NULL; v = v->sig) n += v->exportada;
+    envp_cache = (char **)realloc(envp_cache, (n + 1) * sizeof(char *));
+    for (n = 0, i = 0; i < TAM_HASH; i++)
+        for (v = tabla_variables[i]; v != NULL; v = v->sig)
+            if (v->exportada) envp_cache[n++] = v->cadena;
+    envp_cache[n] = NULL;
+    envp_valido = 1;
+    envp_construidos++;
+    return envp_cache;
+}
+
+// El entorno de un mandato con asignaciones delante: las suyas primero y después las del entorno que no tapan. Sin
+// asignaciones es el de siempre; si no, uno nuevo que quien llama libera
+char **entorno_mandato(char **prefijos) {
+    char **base, **envp;
+    int i, j, k, n;
+    size_t largo;
+
+    base = entorno();
+    if (prefijos == NULL || prefijos[0] == NULL) return base;
+    for (k = 0; prefijos[k] != NULL; k++);
+    for (n = 0; base[n] != NULL; n++);
+    envp = (char **)malloc((k + n + 1) * sizeof(char *));
+    memcpy(envp, prefijos, k * sizeof(char *));
+    for (i = 0, n = k; base[i] != NULL; i++) {
+        for (j = 0; j < k; j++) {
+            largo = strchr(prefijos[j], '=') - prefijos[j] + 1;
+            if (strncmp(base[i], prefijos[j], largo) == 0) break;
+        }
+        if (j == k) envp[n++] = base[i];
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+// Asignaciones de delante del mandato de la etapa, NULL si no tiene
+char **prefijos_etapa(int etapa) {
+    return prefijos_linea == NULL ? NULL : prefijos_linea[etapa];
+}
+
+int comparar_variables(const void *a, const void *b) {
+    return strcmp((*(tvariable **)a)->cadena, (*(tvariable **)b)->cadena);
+}
+
+// Manejador CTRL + C
+void manejador_sigint() {
+    int i;
+    // Salir solo del job en foreground, no de la minishell
+    if (job_fg != NULL)
+        for (i = 0; i < job_fg->nprocesos; i++)
+            if (job_fg->pids[i] != -1 && job_fg->estados[i] == -1) kill(job_fg->pids[i], SIGKILL);
+    if (captura_fg != -1) kill(captura_fg, SIGKILL);
+    interrumpido = 1;
+    printf("\n");
+}
+
+void ejecutar_interno(tline *linea) {
+    tinterno *interno;
+    ultimo_estado = 0;  // Los mandatos internos lo ponen a 1 si fallan, los externos con el status del hijo
+    // time y parallel van delante del resto de la línea
+    if (strcmp(linea->commands[0].argv[0], "time") == 0) tiempo(linea);
+    else if (strcmp(linea->commands[0].argv[0], "parallel") == 0) parallel(linea);
+    // Un mandato interno suelto se ejecuta en la propia minishell, sin crear ningún proceso. En background o en un pipeline se encarga ejecutar_externo
+    else if (linea->ncommands == 1 && !linea->background && (interno = buscar_interno(linea->commands[0].argv[0])) != NULL) ejecutar_suelto(linea, interno);
+    else ejecutar_externo(linea); // Ejecutar mandato externo
+}
+
+// Buscar un mandato en la tabla de internos, NULL si no lo es
+tinterno *buscar_interno(char *nombre) {
+    tinterno *interno;
+    for (interno = internos; interno->nombre != NULL; interno++)
+        if (interno->nombre[0] == nombre[0] && strcmp(interno->nombre, nombre) == 0) return interno;
+    return NULL;
+}
+
+// Ejecutar un mandato interno en la minishell con la salida y el error puestos en los descriptores dados (-1 si no se tocan),
+// y devolverlos a su sitio al terminar. Ninguno lee de la entrada estándar, así que esa no se toca. Las asignaciones de
+// delante (prefijos, NULL si no hay) valen, exportadas, mientras se ejecuta, y después las variables vuelven a como estaban
+void ejecutar_en_proceso(tinterno *interno, char **argv, int salida, int error, char **prefijos) {
+    int salida_original = -1, error_original = -1, i, n, largo;
+    tvariable *v, *antes = NULL;
+
+    for (n = 0; prefijos != NULL && prefijos[n] != NULL; n++);
+    if (n > 0) {
+        antes = (tvariable *)malloc(n * sizeof(tvariable));
+        for (i = 0; i < n; i++) {
+            largo = es_asignacion(prefijos[i]);
+            v = buscar_variable(prefijos[i], largo);
+            antes[i].cadena = v == NULL ? NULL : strdup(v->cadena);
+            antes[i].exportada = v == NULL ? 0 : v->exportada;
+            asignar_variable(prefijos[i], largo, prefijos[i] + largo + 1, 1);
+        }
+    }
+
+    if (salida != -1 && salida != STDOUT_FILENO) {  // Sin redirección no se vacía stdout, así el prompt y la salida van juntos en un write
+        fflush(stdout);
+        salida_original = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(salida, STDOUT_FILENO);
+    }
+    if (error != -1 && error != STDERR_FILENO) {
+        error_original = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(error, STDERR_FILENO);
+    }
+    interno->funcion(argv);
+    if (salida_original != -1) {
+        fflush(stdout);
+        dup2(salida_original, STDOUT_FILENO);
+        close(salida_original);
+    }
+    if (error_original != -1) {
+        dup2(error_original, STDERR_FILENO);
+        close(error_original);
+    }
+    for (i = n - 1; i >= 0; i--) {  // Al revés, por si la misma variable se asignó dos veces
+        largo = es_asignacion(prefijos[i]);
+        if (antes[i].cadena == NULL) borrar_variable(prefijos[i], largo);
+        else asignar_variable(antes[i].cadena, largo, antes[i].cadena + largo + 1, antes[i].exportada);
+        free(antes[i].cadena);
+    }
+    free(antes);
+}
+
+// Mandato interno sin pipes ni background, con sus redirecciones abiertas igual que las de un externo
+void ejecutar_suelto(tline *linea, tinterno *interno) {
+    tredirecciones redir;
+
+    if (abrir_redirecciones(linea, &redir) == -1) {
+        ultimo_estado = 1;
+        return;
+    }
+    trazar_redirecciones(linea, NULL, &redir);  // Sin job, el mandato no crea ninguno
+    ejecutar_en_proceso(interno, linea->commands[0].argv, redir.salida != -1 ? redir.salida : salida_defecto,
+                        linea->error_to_output != NULL ? STDOUT_FILENO : redir.error != -1 ? redir.error : error_defecto, prefijos_etapa(0));
+    cerrar_redirecciones(&redir);
+}
+
+// Implementación cd
+void cd(char **argv) {
+    char *dir = argv[1], buf[PATH_MAX];
+    if (dir == NULL) {
+        dir = valor_variable("HOME");
+        if (dir == NULL) {
+            fprintf(stderr, "cd: Error: HOME no está definida.\n");
+            ultimo_estado = 1;
+            return;
+        }
+        if (chdir(dir) != 0) {
+            perror("cd");
+            ultimo_estado = 1;
+            return;
+        }
+    }
+    else if (chdir(dir) != 0) {
+        fprintf(stderr, "cd: Error: no se ha podido cambiar al directorio %s\n", dir);
+        ultimo_estado = 1;
+        return;
+    }
+    if (getcwd(buf, sizeof(buf)) != NULL) asignar_variable("PWD", 3, buf, -1);  // Para los hijos que miran $PWD
+}
+
+// Implementación jobs, con -l también cada etapa con su pid, su tiempo y los recursos que ha gastado si ya terminó
+void jobs(char **argv) {
+    char *opcion = argv[1];
+    int i, j, largo;
+    largo = opcion != NULL && strcmp(opcion, "-l") == 0;
+    if (opcion != NULL && !largo) {
+        fprintf(stderr, "jobs: Error: la única opción es -l.\n");
+        ultimo_estado = 1;
+        return;
+    }
+    // La tabla ya está al día, recoger_hijos la actualiza según terminan los hijos, no hace falta preguntar por cada pid
+    for (i = 0; i < max_jobs; i++) {
+        if (jobs_bg[i] == NULL) continue;
+        printf("[%d] Running        %s&\n", jobs_bg[i]->id, jobs_bg[i]->nombre);
+        if (largo)
+            for (j = 0; j < jobs_bg[i]->nprocesos; j++) informe_etapa(stdout, jobs_bg[i], j);
+    }
+}
+
+// Implementación fg
+void fg(char **argv) {
+    char *identificador = argv[1];
+    tjob *job = NULL;
+    int i, id, status;
+
+    if (subshell) {  // Los jobs son de la minishell, no de este proceso
+        fprintf(stderr, "fg: Error: no hay control de jobs en un pipeline.\n");
+        ultimo_estado = 1;
+        return;
+    }
+    if (identificador != NULL) {
+        id = atoi(identificador);
+        if (id >= 1 && id <= max_jobs) job = jobs_bg[id - 1];
+    } else {
+        job = ultimo_job;
+        for (i = max_jobs - 1; i >= 0 && job == NULL; i--) job = jobs_bg[i];  // Si el último ya terminó, el de id más alto
+    }
+
+    if (job != NULL) { // Para evitar error si la lista está vacía o el job que le mandamos no está activo
+        printf("%s\n", job->nombre);
+        esperar_job(job);  // En caso de que se haga ctrl + c, se matará a este job en concreto
+        status = job->estados[job->nprocesos - 1];  // Como si se hubiera lanzado en foreground
+        ultimo_estado = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        liberar_job(job);
+        return;
+    }
+
+    fprintf(stderr, "fg: No hay ningún proceso en segundo plano o no se ha podido ejecutar el pid proporcionado en primer plano.\n");
+    ultimo_estado = 1;
+}
+
+void mandato_umask(char **argv) {
+    chumask(argv[1]);
+}
+
+// Implementación umask
+void chumask(char *mask) {
+    int mascara;
+    // Comprobar si se ha pasado un argumento y si es válido
+    if (mask != NULL) {
+        // Comprobar si es un número
+        if (sscanf(mask, "%o", &mascara) != 1) {  // %o para que se lea como octal
+            fprintf(stderr, "umask: Error: el argumento proporcionado no es un octal.\n");
+            ultimo_estado = 1;
+            return;
+        }
+        // Comprobar si es un número válido
+        if (mascara < 0000 || mascara > 0777) {
+            fprintf(stderr, "umask: Error: el argumento proporcionado no es una máscara válida.\n");
+            ultimo_estado = 1;
+            return;
+        }
+        // Cambiar la máscara, también la del proceso para que la hereden los hijos creados con posix_spawn
+        umask_val = mascara;
+        umask(umask_val);
+        return;
+    }
+    // Si no se ha pasado un argumento, se muestra la máscara actual
+    printf("%04o\n", umask_val);
+}
+
+void mandato_spawn(char **argv) {
+    spawn(argv[1]);
+}
+
+// Implementación sched, sin argumentos muestra la política con la que se crean los hijos.
+// --spread, --pack y --cpus lista ponen la afinidad de cada etapa, --nice n y --ioprio n su prioridad y --off lo quita todo
+void sched(char **argv) {
+    char buf[256];
+    int i, n, modo = plan_modo, nice_nuevo = plan_nice, ioprio_nuevo = plan_ioprio;
+    cpu_set_t cpus = plan_cpus;
+    char *fin;
+
+    if (argv[1] == NULL) {
+        if (!plan_activo()) {
+            printf("ninguna\n");
+            return;
+        }
+        formato_cpus(&plan_cpus, buf, sizeof(buf));
+        if (plan_modo == PLAN_NINGUNA) printf("sin afinidad");
+        else printf("%s cpus %s", plan_modo == PLAN_PACK ? "pack" : plan_modo == PLAN_SPREAD ? "spread" : "todas", buf);
+        if (plan_nice != SIN_NICE) printf(" nice %d", plan_nice);
+        if (plan_ioprio != -1) printf(" ioprio %d", plan_ioprio);
+        printf("\n");
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "--off") == 0) {
+            modo = PLAN_NINGUNA;
+            nice_nuevo = SIN_NICE;
+            ioprio_nuevo = -1;
+            sched_getaffinity(0, sizeof(cpus), &cpus);
+        } else if (strcmp(argv[i], "--spread") == 0) modo = PLAN_SPREAD;
+        else if (strcmp(argv[i], "--pack") == 0) modo = PLAN_PACK;
+        else if (strcmp(argv[i], "--cpus") == 0 && argv[i + 1] != NULL) {
+            if (leer_cpus(argv[++i], &cpus) != 0) {
+                fprintf(stderr, "sched: Error: %s no es una lista de CPUs válida (como 0-3,8).\n", argv[i]);
+                ultimo_estado = 1;
+                return;
+            }
+            if (modo == PLAN_NINGUNA) modo = PLAN_CPUS;
+        } else if ((strcmp(argv[i], "--nice") == 0 || strcmp(argv[i], "--ioprio") == 0) && argv[i + 1] != NULL) {
+            n = strtol(argv[i + 1], &fin, 10);
+            if (*fin != '\0' || fin == argv[i + 1] || (argv[i][2] == 'n' ? n < -20 || n > 19 : n < 0 || n > 7)) {
+                fprintf(stderr, "sched: Error: %s debe estar entre %s.\n", argv[i], argv[i][2] == 'n' ? "-20 y 19" : "0 y 7");
+                ultimo_estado = 1;
+                return;
+            }
+            if (argv[i][2] == 'n') nice_nuevo = n;
+            else ioprio_nuevo = n;
+            i++;
+        } else {
+            fprintf(stderr, "sched: Error: uso: sched [--spread | --pack] [--cpus lista] [--nice n] [--ioprio n] | --off\n");
+            ultimo_estado = 1;
+            return;
+        }
+    }
+    plan_modo = modo;
+    plan_nice = nice_nuevo;
+    plan_ioprio = ioprio_nuevo;
+    plan_cpus = cpus;
+    for (plan_num = 0, i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &plan_cpus)) plan_lista[plan_num++] = i;
+}
+
+// Leer una lista de CPUs como 0-3,8,10-11. Solo valen las que puede usar la minishell
+int leer_cpus(char *lista, cpu_set_t *cpus) {
+    cpu_set_t permitidas;
+    long a, b;
+    char *p = lista, *fin;
+
+    sched_getaffinity(0, sizeof(permitidas), &permitidas);
+    CPU_ZERO(cpus);
+    while (*p != '\0') {
+        a = strtol(p, &fin, 10);
+        if (fin == p || a < 0) return -1;
+        b = a;
+        if (*fin == '-') {
+            p = fin + 1;
+            b = strtol(p, &fin, 10);
+            if (fin == p || b < a) return -1;
+        }
+        if (b >= CPU_SETSIZE) return -1;
+        for (; a <= b; a++) {
+            if (!CPU_ISSET(a, &permitidas)) return -1;
+            CPU_SET(a, cpus);
+        }
+        if (*fin == ',') fin++;
+        else if (*fin != '\0') return -1;
+        p = fin;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+// Escribir un conjunto de CPUs como lista con rangos, 0-3,8
+void formato_cpus(cpu_set_t *cpus, char *buf, size_t tam) {
+    int i, j;
+    size_t n = 0;
+
+    buf[0] = '\0';
+    for (i = 0; i < CPU_SETSIZE && n < tam; i++) {
+        if (!CPU_ISSET(i, cpus)) continue;
+        for (j = i; j + 1 < CPU_SETSIZE && CPU_ISSET(j + 1, cpus); j++);
+        if (j == i) n += snprintf(buf + n, tam - n, "%s%d", n > 0 ? "," : "", i);
+        else n += snprintf(buf + n, tam - n, "%s%d-%d", n > 0 ? "," : "", i, j);
+        i = j;
+    }
+}
+
+// CPUs de una etapa según la política, devuelve 0 si no hay afinidad que poner
+int cpus_etapa(tjob *job, int etapa, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    switch (plan_modo) {
+    case PLAN_CPUS:
+        *cpus = plan_cpus;
         return 1;
+    case PLAN_PACK:  // Seguidas desde la primera, las etapas vecinas en el pipeline quedan en CPUs vecinas
+        CPU_SET(plan_lista[etapa % plan_num], cpus);
+        return 1;
+    case PLAN_SPREAD:  // Repartidas por todo el conjunto, si hay más etapas que CPUs se vuelve a empezar
+        CPU_SET(plan_lista[job->nprocesos <= plan_num ? etapa * plan_num / job->nprocesos : etapa % plan_num], cpus);
+        return 1;
+    }
+    return 0;
+}
+
+// Hay algo que poner a los hijos: afinidad, nice o ioprio
+int plan_activo() {
+    return plan_modo != PLAN_NINGUNA || plan_nice != SIN_NICE || plan_ioprio != -1;
+}
+
+// Poner la afinidad, el nice y el ioprio de sched a un proceso (0 es el propio, para el hijo de fork)
+void aplicar_plan(pid_t pid, cpu_set_t *cpus) {
+    if (cpus != NULL && CPU_COUNT(cpus) > 0) sched_setaffinity(pid, sizeof(cpu_set_t), cpus);
+    if (plan_nice != SIN_NICE) setpriority(PRIO_PROCESS, pid, plan_nice);
+    if (plan_ioprio != -1) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | plan_ioprio);
+}
+
+// CPU en la que está ahora un proceso, el campo 39 de /proc/pid/stat. -1 si no se puede saber
+int cpu_actual(pid_t pid) {
+    char ruta[64], buf[1024], *p;
+    int fd, i, cpu = -1;
+    ssize_t n;
+
+    snprintf(ruta, sizeof(ruta), "/proc/%d/stat", pid);
+    fd = open(ruta, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    p = strrchr(buf, ')');  // El nombre del mandato puede tener espacios, se cuenta desde el final de él
+    for (i = 2; p != NULL && i < 39; i++) p = strchr(p + 1, ' ');
+    if (p != NULL) cpu = atoi(p + 1);
+    return cpu;
+}
+
+// Implementación trace, sin argumentos dice a dónde va la traza, con un fichero la empieza (o cambia de fichero) y con off la para
+void trace(char **argv) {
+    if (argv[1] == NULL) {
+        if (traza == NULL) printf("off\n");
+        else printf("%s (%lu eventos perdidos, %lu bytes sin escribir)\n", fichero_traza, traza_perdidos, atomic_load(&traza_sin_escribir));
+        return;
+    }
+    parar_traza();
+    if (strcmp(argv[1], "off") != 0 && iniciar_traza(argv[1]) != 0) ultimo_estado = 1;
+}
+
+// Abrir el fichero, reservar el anillo y arrancar el hilo que escribe. Devuelve -1 si no se ha podido
+int iniciar_traza(char *fichero) {
+    fd_traza = open(fichero, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666 & ~umask_val);
+    if (fd_traza == -1) {
+        fprintf(stderr, "trace: Error. No se pudo abrir %s, %s\n", fichero, strerror(errno));
+        return -1;
+    }
+    fd_aviso_traza = eventfd(0, EFD_CLOEXEC);
+    traza = (tevento *)malloc(TAM_TRAZA * sizeof(tevento));
+    atomic_store(&traza_cabeza, 0);
+    atomic_store(&traza_cola, 0);
+    traza_terminar = 0;
+    traza_perdidos = 0;
+    atomic_store(&traza_sin_escribir, 0);
+    fichero_traza = strdup(fichero);
+    pid_minishell = getpid();
+    if (pthread_create(&hilo_traza, NULL, escritor_traza, NULL) != 0) {
+        fprintf(stderr, "trace: Error al crear el hilo de escritura.\n");
+        close(fd_traza);
+        close(fd_aviso_traza);
+        free(traza);
+        free(fichero_traza);
+        traza = NULL;
+        fd_traza = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Vaciar lo que quede en el anillo, esperar al hilo y cerrar el fichero
+void parar_traza() {
+    if (traza == NULL) return;
+    traza_terminar = 1;
+    avisar_traza();
+    pthread_join(hilo_traza, NULL);
+    close(fd_traza);
+    close(fd_aviso_traza);
+    free(traza);
+    free(fichero_traza);
+    traza = NULL;
+    fd_traza = -1;
+}
+
+// Guardar un evento en el anillo, sin llamadas al sistema salvo el reloj. Si el anillo está lleno se pierde y se cuenta
+void trazar(int tipo, pid_t pid, tjob *job, int etapa, int dato, int extra, const char *texto) {
+    unsigned long cabeza = atomic_load_explicit(&traza_cabeza, memory_order_relaxed);
+    tevento *ev;
+    struct timespec t;
+
+    if (cabeza - atomic_load_explicit(&traza_cola, memory_order_acquire) >= TAM_TRAZA) {
+        traza_perdidos++;
+        return;
+    }
+    ev = &traza[cabeza & (TAM_TRAZA - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    ev->ns = t.tv_sec * 1000000000LL + t.tv_nsec;
+    ev->tipo = tipo;
+    ev->pid = pid;
+    ev->job = job != NULL ? job->numero : 0;
+    ev->etapa = etapa;
+    ev->dato = dato;
+    ev->extra = extra;
+    ev->texto[0] = '\0';
+    if (texto != NULL) {
+        strncpy(ev->texto, texto, sizeof(ev->texto) - 1);
+        ev->texto[sizeof(ev->texto) - 1] = '\0';
+    }
+    atomic_store_explicit(&traza_cabeza, cabeza + 1, memory_order_release);
+    if (cabeza - atomic_load_explicit(&traza_cola, memory_order_relaxed) == TAM_TRAZA / 2) avisar_traza();  // Que no se llene antes de acabar la línea
+}
+
+// Evento escrito directamente en el fichero desde un hijo de fork, que no tiene el hilo que vacía el anillo
+void trazar_hijo(int tipo, tjob *job, int etapa, int dato, const char *texto) {
+    tevento ev;
+    char buf[512];
+    struct timespec t;
+
+    if (fd_traza == -1) return;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    ev.ns = t.tv_sec * 1000000000LL + t.tv_nsec;
+    ev.tipo = tipo;
+    ev.pid = getpid();
+    ev.job = job->numero;
+    ev.etapa = etapa;
+    ev.dato = dato;
+    ev.extra = 0;
+    strncpy(ev.texto, texto, sizeof(ev.texto) - 1);
+    ev.texto[sizeof(ev.texto) - 1] = '\0';
+    if (write(fd_traza, buf, formato_evento(&ev, buf, sizeof(buf))) == -1) return;  // O_APPEND, no se mezcla con lo del hilo
+}
+
+// Despertar al hilo que escribe, se hace al acabar cada línea y no en cada evento
+void avisar_traza() {
+    uint64_t uno = 1;
+    if (write(fd_aviso_traza, &uno, sizeof(uno)) != sizeof(uno)) return;
+}
+
+// Hilo que pasa los eventos del anillo al fichero como líneas JSON. Formatea en un buffer propio y solo usa write,
+// sin FILE ni malloc, así no tiene cerrojos que pueda heredar a medias un hijo de fork
+void *escritor_traza(void *arg) {
+    char buf[65536];
+    size_t n = 0;
+    uint64_t avisos;
+    unsigned long cola;
+    tevento *ev;
+    (void)arg;
+
+    while (1) {
+        if (read(fd_aviso_traza, &avisos, sizeof(avisos)) == -1 && errno == EINTR) continue;
+        cola = atomic_load_explicit(&traza_cola, memory_order_relaxed);
+        while (cola != atomic_load_explicit(&traza_cabeza, memory_order_acquire)) {
+            ev = &traza[cola & (TAM_TRAZA - 1)];
+            if (sizeof(buf) - n < 512) {
+                escribir_traza(buf, n);
+                n = 0;
+            }
+            n += formato_evento(ev, buf + n, sizeof(buf) - n);
+            atomic_store_explicit(&traza_cola, ++cola, memory_order_release);
+        }
+        if (n > 0) escribir_traza(buf, n);
+        n = 0;
+        if (traza_terminar) return NULL;
+    }
+}
+
+// Pasar el buffer del hilo al fichero. Lo que no se pueda escribir (disco lleno, por ejemplo) se descarta y se cuenta,
+// el hilo no puede quedarse esperando con el anillo lleno
+void escribir_traza(char *buf, size_t n) {
+    ssize_t escrito = write(fd_traza, buf, n);
+    if (escrito < (ssize_t)n) atomic_fetch_add(&traza_sin_escribir, n - (escrito > 0 ? escrito : 0));
+}
+
+// Un evento como línea JSON. Los campos comunes y después los del tipo de evento
+size_t formato_evento(tevento *ev, char *buf, size_t tam) {
+    static const char *nombres[] = { "linea", "pipe", "redir", "fork", "exec", "exit", "job" };
+    char texto[2 * sizeof(ev->texto)];
+    size_t n;
+    int i, j;
+
+    for (i = 0, j = 0; ev->texto[i] != '\0'; i++) {  // Escapar las comillas y barras, y quitar los caracteres de control
+        if (ev->texto[i] == '"' || ev->texto[i] == '\\') texto[j++] = '\\';
+        texto[j++] = (unsigned char)ev->texto[i] < ' ' ? '?' : ev->texto[i];
+    }
+    texto[j] = '\0';
+    n = snprintf(buf, tam, "{\"ns\":%lld,\"ev\":\"%s\",\"pid\":%d,\"job\":%lu,\"etapa\":%d", ev->ns, nombres[ev->tipo], ev->pid, ev->job, ev->etapa);
+    switch (ev->tipo) {
+    case EV_LINEA: n += snprintf(buf + n, tam - n, ",\"mandatos\":%d,\"mandato\":\"%s\"}\n", ev->dato, texto); break;
+    case EV_PIPE: n += snprintf(buf + n, tam - n, ",\"lectura\":%d,\"escritura\":%d}\n", ev->dato, ev->extra); break;
+    case EV_REDIR: n += snprintf(buf + n, tam - n, ",\"fd\":%d,\"a\":%d,\"fichero\":\"%s\"}\n", ev->dato, ev->extra, texto); break;
+    case EV_FORK: n += snprintf(buf + n, tam - n, ",\"mandato\":\"%s\"}\n", texto); break;
+    case EV_EXEC: n += snprintf(buf + n, tam - n, ",\"ok\":%s,\"errno\":%d,\"mandato\":\"%s\"}\n", ev->dato == 0 ? "true" : "false", ev->dato, texto); break;
+    case EV_EXIT: n += snprintf(buf + n, tam - n, ",\"status\":%d,\"cpu_us\":%d}\n", ev->dato, ev->extra); break;
+    case EV_JOB: n += snprintf(buf + n, tam - n, ",\"status\":%d}\n", ev->dato); break;
+    }
+    return n;
+}
+
+// Implementación spawn, sin argumentos muestra cómo se crean los procesos, con fork o posix_spawn lo cambia
+void spawn(char *modo) {
+    if (modo == NULL) printf("%s\n", modo_lanzamiento == LANZAR_FORK ? "fork" : "posix_spawn");
+    else if (strcmp(modo, "fork") == 0) modo_lanzamiento = LANZAR_FORK;
+    else if (strcmp(modo, "posix_spawn") == 0 || strcmp(modo, "vfork") == 0) modo_lanzamiento = LANZAR_SPAWN;
+    else {
+        fprintf(stderr, "spawn: Error: el modo debe ser fork o posix_spawn.\n");
+        ultimo_estado = 1;
+    }
+}
+
+// Implementación time, ejecuta el resto de la línea y saca por la salida de error el tiempo real y la CPU.
+// Para un mandato externo en foreground lo hace ejecutar_externo con el desglose por etapas, si no se mide la propia minishell
+void tiempo(tline *linea) {
+    struct timespec inicio, fin;
+    struct rusage antes, despues;
+
+    if (linea->commands[0].argc == 1) {
+        fprintf(stderr, "time: Error: falta el mandato.\n");
+        ultimo_estado = 1;
+        return;
+    }
+    // Quitar time del primer mandato, el argv está en la arena de la línea
+    linea->commands[0].argv++;
+    linea->commands[0].argc--;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    getrusage(RUSAGE_SELF, &antes);
+    medir_tiempo = 1;
+    ejecutar_interno(linea);
+    if (medir_tiempo) {
+        clock_gettime(CLOCK_MONOTONIC, &fin);
+        getrusage(RUSAGE_SELF, &despues);
+        fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs\n", segundos(&inicio, &fin),
+                (despues.ru_utime.tv_sec - antes.ru_utime.tv_sec) + (despues.ru_utime.tv_usec - antes.ru_utime.tv_usec) / 1e6,
+                (despues.ru_stime.tv_sec - antes.ru_stime.tv_sec) + (despues.ru_stime.tv_usec - antes.ru_stime.tv_usec) / 1e6);
+        medir_tiempo = 0;
+    }
+}
+
+// Implementación parallel, ejecuta la línea una vez por argumento sustituyendo {} por él (o añadiéndolo al final si no aparece),
+// con como mucho n jobs a la vez. Los argumentos son los de detrás de ::: o, si no hay, uno por línea de la entrada (o del fichero de <).
+// Cada job escribe en un memfd propio que se vuelca al terminar, así las salidas no se mezclan. El status es el número de jobs que fallan
+void parallel(tline *linea) {
+    tline *plantilla, *trabajo;
+    tarena arena_plantilla = { NULL, NULL }, arena_trabajo = { NULL, NULL };
+    tcommand *ultimo;
+    tlector lector = { -1, NULL, 0, 0, 0 }, *origen = NULL;
+    tjob **huecos;
+    int *salidas, *errores;     // memfd de salida y de error de cada hueco, se reutilizan de un job al siguiente
+    char **args = NULL, **argv = linea->commands[0].argv;
+    char *arg, *valor, *fin;
+    int max, i, j, corriendo = 0, fallos = 0, anadir = 1, status;
+    struct pollfd pfd;
+
+    // Opciones, -j n o -jn
+    max = sysconf(_SC_NPROCESSORS_ONLN);
+    i = 1;
+    if (argv[i] != NULL && strncmp(argv[i], "-j", 2) == 0) {
+        valor = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+        if (valor == NULL || (max = strtol(valor, &fin, 10)) <= 0 || *fin != '\0') {
+            fprintf(stderr, "parallel: Error: -j necesita un número de jobs mayor que 0.\n");
+            ultimo_estado = 1;
+            return;
+        }
+        i++;
+    }
+    // La plantilla es la línea sin parallel ni sus opciones, y sin lo que va detrás de ::: en el último mandato
+    linea->commands[0].argv += i;
+    linea->commands[0].argc -= i;
+    ultimo = &linea->commands[linea->ncommands - 1];
+    for (j = 0; j < ultimo->argc; j++) {
+        if (strcmp(ultimo->argv[j], ":::") == 0) {
+            args = &ultimo->argv[j + 1];
+            ultimo->argv[j] = NULL;
+            ultimo->argc = j;
+            break;
+        }
+    }
+    for (j = 0; j < linea->ncommands; j++) {
+        if (linea->commands[j].argc == 0) {
+            fprintf(stderr, "parallel: Error: falta el mandato.\n");
+            ultimo_estado = 1;
+            return;
+        }
+    }
+    // Copia propia, la línea apunta al buffer del lector y puede moverse si los argumentos se leen de la entrada
+    plantilla = copiar_linea(&arena_plantilla, linea, NULL, 0);
+    if (args != NULL) {
+        for (j = 0; args[j] != NULL; j++) args[j] = arena_strdup(&arena_plantilla, args[j]);
+    }
+    for (i = 0; i < plantilla->ncommands && anadir; i++)
+        for (j = 0; j < plantilla->commands[i].argc && anadir; j++)
+            if (strstr(plantilla->commands[i].argv[j], "{}") != NULL) anadir = 0;
+    if ((plantilla->redirect_output != NULL && strstr(plantilla->redirect_output, "{}") != NULL) ||
+        (plantilla->redirect_error != NULL && strstr(plantilla->redirect_error, "{}") != NULL)) anadir = 0;
+
+    if (args == NULL) {
+        if (plantilla->redirect_input != NULL || plantilla->redirect_string != NULL) {  // parallel mandato {} < lista (o <<< lista), la lista es de parallel y no de los jobs
+            lector.fd = abrir_entrada(plantilla);
+            if (lector.fd == -1) {
+                arena_liberar(&arena_plantilla);
+                ultimo_estado = 1;
+                return;
+            }
+            origen = &lector;
+        } else if (entrada.fd == STDIN_FILENO) origen = &entrada;  // Las líneas que quedan de la entrada de la minishell
+        else {
+            lector.fd = STDIN_FILENO;
+            origen = &lector;
+        }
+        plantilla->redirect_input = "/dev/null";  // Que los jobs no se coman los argumentos
+        plantilla->redirect_string = NULL;
+    }
+
+    huecos = (tjob **)calloc(max, sizeof(tjob *));
+    salidas = (int *)malloc(max * sizeof(int));
+    errores = (int *)malloc(max * sizeof(int));
+    for (i = 0; i < max; i++) salidas[i] = errores[i] = -1;
+    interrumpido = 0;
+    if (interactivo) signal(SIGINT, manejador_sigint);
+    pfd.fd = fd_sigchld;
+    pfd.events = POLLIN;
+
+    while (1) {
+        // Lanzar jobs mientras haya huecos y argumentos
+        while (corriendo < max && !interrumpido) {
+            if (args != NULL) arg = *args != NULL ? *args++ : NULL;
+            else do arg = siguiente_linea(origen); while (arg != NULL && arg[0] == '\0');
+            if (arg == NULL) break;
+            for (i = 0; huecos[i] != NULL; i++);
+            if (salidas[i] == -1) {
+                salidas[i] = memfd_create("parallel", MFD_CLOEXEC);
+                errores[i] = memfd_create("parallel", MFD_CLOEXEC);
+            }
+            arena_reset(&arena_trabajo);
+            trabajo = copiar_linea(&arena_trabajo, plantilla, arg, anadir);
+            trabajo->background = 1;  // Sin id, pero con los pids en la tabla para que los recoja recoger_hijos
+            salida_defecto = salidas[i];
+            error_defecto = errores[i];
+            huecos[i] = lanzar_job(trabajo);
+            salida_defecto = -1;
+            error_defecto = -1;
+            if (huecos[i] == NULL || huecos[i]->vivos == 0) {  // No se ha podido lanzar, el error ya ha salido por la minishell
+                if (huecos[i] != NULL) liberar_job(huecos[i]);
+                huecos[i] = NULL;
+                fallos++;
+                continue;
+            }
+            corriendo++;
+        }
+        if (corriendo == 0) break;
+
+        // Esperar a que termine alguno y volcar su salida entera
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) break;
+        recoger_hijos(0);
+        for (i = 0; i < max; i++) {
+            if (huecos[i] == NULL) continue;
+            if (interrumpido)
+                for (j = 0; j < huecos[i]->nprocesos; j++)
+                    if (huecos[i]->pids[j] != -1 && huecos[i]->estados[j] == -1) kill(huecos[i]->pids[j], SIGKILL);
+            if (huecos[i]->vivos > 0) continue;
+            status = huecos[i]->estados[huecos[i]->nprocesos - 1];
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fallos++;
+            volcar_salida(salidas[i], STDOUT_FILENO);
+            volcar_salida(errores[i], STDERR_FILENO);
+            liberar_job(huecos[i]);
+            huecos[i] = NULL;
+            corriendo--;
+        }
+    }
+
+    if (interactivo) signal(SIGINT, SIG_IGN);
+    interrumpido = 0;
+    for (i = 0; i < max; i++) {
+        if (huecos[i] != NULL) liberar_job(huecos[i]);
+        if (salidas[i] != -1) close(salidas[i]);
+        if (errores[i] != -1) close(errores[i]);
+    }
+    free(huecos);
+    free(salidas);
+    free(errores);
+    if (origen == &lector) {
+        if (lector.fd != STDIN_FILENO) close(lector.fd);
+        free(lector.buf);
+    }
+    arena_liberar(&arena_plantilla);
+    arena_liberar(&arena_trabajo);
+    ultimo_estado = fallos > 255 ? 255 : fallos;
+}
+
+// Copiar la línea en la arena cambiando {} por arg en los argumentos y las redirecciones, y con anadir además arg al final.
+// Con arg a NULL es una copia tal cual
+tline *copiar_linea(tarena *arena, tline *linea, char *arg, int anadir) {
+    tline *copia;
+    tcommand *c;
+    int i, j;
+
+    copia = (tline *)arena_alloc(arena, sizeof(tline));
+    *copia = *linea;
+    copia->commands = (tcommand *)arena_alloc(arena, linea->ncommands * sizeof(tcommand));
+    for (i = 0; i < linea->ncommands; i++) {
+        c = &copia->commands[i];
+        c->filename = NULL;
+        c->argc = linea->commands[i].argc + (anadir && i == linea->ncommands - 1);
+        c->argv = (char **)arena_alloc(arena, (c->argc + 1) * sizeof(char *));
+        for (j = 0; j < linea->commands[i].argc; j++) c->argv[j] = sustituir(arena, linea->commands[i].argv[j], arg);
+        if (j < c->argc) c->argv[j++] = arg;
+        c->argv[j] = NULL;
+    }
+    if (linea->redirect_input != NULL) copia->redirect_input = sustituir(arena, linea->redirect_input, arg);
+    if (linea->redirect_output != NULL) copia->redirect_output = sustituir(arena, linea->redirect_output, arg);
+    if (linea->redirect_error != NULL) copia->redirect_error = sustituir(arena, linea->redirect_error, arg);
+    if (linea->redirect_string != NULL) copia->redirect_string = sustituir(arena, linea->redirect_string, arg);
+    if (linea->error_to_output != NULL) {
+        copia->error_to_output = (int *)arena_alloc(arena, linea->ncommands * sizeof(int));
+        memcpy(copia->error_to_output, linea->error_to_output, linea->ncommands * sizeof(int));
+    }
+    return copia;
+}
+
+// La palabra con cada {} cambiado por arg. Sin arg se copia, y si no tiene {} se devuelve la misma
+char *sustituir(tarena *arena, char *palabra, char *arg) {
+    char *p, *q, *llave, *nueva;
+    size_t veces = 0, largo;
+
+    if (arg == NULL) return arena_strdup(arena, palabra);
+    for (p = strstr(palabra, "{}"); p != NULL; p = strstr(p + 2, "{}")) veces++;
+    if (veces == 0) return palabra;
+    largo = strlen(arg);
+    nueva = (char *)arena_alloc(arena, strlen(palabra) + veces * largo + 1);
+    for (p = palabra, q = nueva; (llave = strstr(p, "{}")) != NULL; p = llave + 2) {
+        memcpy(q, p, llave - p);
+        q += llave - p;
+        memcpy(q, arg, largo);
+        q += largo;
+    }
+    strcpy(q, p);
+    return nueva;
+}
+
+// Copiar lo que ha escrito un job en su memfd y dejarlo vacío para el siguiente
+void volcar_salida(int fd, int destino) {
+    char buf[65536];
+    ssize_t n;
+
+    fflush(stdout);
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        if (write(destino, buf, n) != n) break;
+    if (ftruncate(fd, 0) == -1) fprintf(stderr, "parallel: Error al vaciar la salida, %s\n", strerror(errno));
+    lseek(fd, 0, SEEK_SET);
+}
+
+// Implementación hash, sin argumentos muestra la tabla, con -r la vacía y con nombres de mandatos los añade
+void hash(char **argv) {
+    int i;
+    entrada_hash *e;
+
+    if (argv[1] == NULL) {
+        printf("usos\tmandato\n");
+        for (i = 0; i < TAM_HASH; i++)
+            for (e = tabla_hash[i]; e != NULL; e = e->sig) printf("%4d\t%s\n", e->usos, e->ruta);
+        printf("aciertos: %lu, fallos: %lu\n", hash_aciertos, hash_fallos);
+        printf("directorios de los comodines: %lu KB, aciertos: %lu, fallos: %lu\n", (unsigned long)(bytes_glob >> 10), glob_aciertos, glob_fallos);
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            vaciar_hash();
+            vaciar_glob();
+            hash_aciertos = hash_fallos = 0;
+            glob_aciertos = glob_fallos = 0;
+        }
+        else if (buscar_mandato(argv[i]) == NULL) {
+            fprintf(stderr, "hash: %s: No se encuentra el mandato.\n", argv[i]);
+            ultimo_estado = 1;
+        }
+    }
+}
+
+// Implementación history: las últimas n entradas (todas sin n), las que empiezan por un prefijo (búsqueda binaria en el
+// índice ordenado) o las que contienen un texto (memmem en todo el fichero proyectado), cada una con su número para !n
+void history(char **argv) {
+    int num, i, ini, fin, mitad, r, n = 0, *encontradas;
+    char *texto, *p, *fin_mapa;
+    size_t largo, l;
+
+    if (fd_historia == -1) {
+        fprintf(stderr, "history: Error: no hay historia, solo se guarda en modo interactivo y con HOME.\n");
+        ultimo_estado = 1;
+        return;
+    }
+    num = sincronizar_historia();
+    if (argv[1] == NULL || (argv[2] == NULL && isdigit((unsigned char)argv[1][0]))) {
+        for (i = argv[1] == NULL || atoi(argv[1]) > num ? 0 : num - atoi(argv[1]); i < num; i++) {
+            texto = entrada_historia(i, &l);
+            printf("%5d  %.*s\n", i + 1, (int)l, texto);
+        }
+        return;
+    }
+    if (argv[2] == NULL || argv[3] != NULL || (strcmp(argv[1], "-p") != 0 && strcmp(argv[1], "-s") != 0)) {
+        fprintf(stderr, "history: Uso: history [n | -p prefijo | -s texto]\n");
+        ultimo_estado = 1;
+        return;
+    }
+    largo = strlen(argv[2]);
+    if (strcmp(argv[1], "-p") == 0) {
+        ordenar_historia();
+        // La primera entrada que no va antes que el prefijo, y desde ella todas las que empiezan por él
+        ini = 0;
+        fin = num;
+        while (ini < fin) {
+            mitad = (ini + fin) / 2;
+            texto = entrada_historia(orden_historia[mitad], &l);
+            r = memcmp(texto, argv[2], l < largo ? l : largo);
+            if (r < 0 || (r == 0 && l < largo)) ini = mitad + 1;
+            else fin = mitad;
+        }
+        for (fin = ini; fin < num; fin++) {
+            texto = entrada_historia(orden_historia[fin], &l);
+            if (l < largo || memcmp(texto, argv[2], largo) != 0) break;
+        }
+        // Se muestran por orden de antigüedad, como el resto
+        encontradas = (int *)malloc((fin - ini + 1) * sizeof(int));
+        memcpy(encontradas, orden_historia + ini, (fin - ini) * sizeof(int));
+        qsort(encontradas, fin - ini, sizeof(int), comparar_enteros);
+        for (i = 0; i < fin - ini; i++) {
+            texto = entrada_historia(encontradas[i], &l);
+            printf("%5d  %.*s\n", encontradas[i] + 1, (int)l, texto);
+        }
+        n = fin - ini;
+        free(encontradas);
+    } else if (num > 0) {
+        fin_mapa = mapa_historia + lineas_historia[num];
+        for (p = mapa_historia; (p = memmem(p, fin_mapa - p, argv[2], largo)) != NULL; p = mapa_historia + lineas_historia[i + 1]) {
+            // La entrada en la que ha caído: la última que empieza antes
+            ini = 0;
+            fin = num;
+            while (ini < fin) {
+                mitad = (ini + fin) / 2;
+                if (lineas_historia[mitad] <= (size_t)(p - mapa_historia)) ini = mitad + 1;
+                else fin = mitad;
+            }
+            i = ini - 1;
+            texto = entrada_historia(i, &l);
+            printf("%5d  %.*s\n", i + 1, (int)l, texto);
+            n++;
+        }
+    }
+    if (n == 0) ultimo_estado = 1;  // Como grep, para poder usarlo en un test
+}
+
+// Implementación export: sin argumentos muestra las variables exportadas, ordenadas. Con nombre=valor le da valor y la
+// exporta, y con solo el nombre exporta la que ya existe (o la crea vacía)
+void mandato_export(char **argv) {
+    tvariable *v, **lista;
+    int i, n = 0, largo;
+
+    if (argv[1] == NULL) {
+        for (i = 0; i < TAM_HASH; i++)
+            for (v = tabla_variables[i]; v != NULL; v = v->sig) n += v->exportada;
+        lista = (tvariable **)malloc((n + 1) * sizeof(tvariable *));
+        for (n = 0, i = 0; i < TAM_HASH; i++)
+            for (v = tabla_variables[i]; v != NULL; v = v->sig)
+                if (v->exportada) lista[n++] = v;
+        qsort(lista, n, sizeof(tvariable *), comparar_variables);
+        for (i = 0; i < n; i++) printf("export %s\n", lista[i]->cadena);
+        free(lista);
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        largo = es_asignacion(argv[i]);
+        if (largo > 0) {
+            asignar_variable(argv[i], largo, argv[i] + largo + 1, 1);
+            continue;
+        }
+        for (largo = 0; isalnum((unsigned char)argv[i][largo]) || argv[i][largo] == '_'; largo++);
+        if (largo == 0 || argv[i][largo] != '\0' || isdigit((unsigned char)argv[i][0])) {
+            fprintf(stderr, "export: Error: %s no es un nombre de variable válido.\n", argv[i]);
+            ultimo_estado = 1;
+            continue;
+        }
+        v = buscar_variable(argv[i], largo);
+        if (v == NULL) asignar_variable(argv[i], largo, "", 1);
+        else if (!v->exportada) {
+            v->exportada = 1;
+            envp_valido = 0;
+        }
+    }
+}
+
+// Implementación unset
+void unset(char **argv) {
+    int i;
+    for (i = 1; argv[i] != NULL; i++) borrar_variable(argv[i], strlen(argv[i]));
+}
+
+// Implementación echo, solo con -n
+void echo(char **argv) {
+    int i = 1, salto = 1;
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+        salto = 0;
+        i++;
+    }
+    for (; argv[i] != NULL; i++) {
+        fputs(argv[i], stdout);
+        if (argv[i + 1] != NULL) putchar(' ');
+    }
+    if (salto) putchar('\n');
+}
+
+// Implementación printf, cada conversión del formato se hace con la de la libc sobre el argumento ya convertido.
+// El formato se repite mientras queden argumentos, como en bash, y los que faltan valen "" o 0
+void mandato_printf(char **argv) {
+    char *p, *arg, *fin, spec[32];
+    char letra[2] = { 0, 0 };
+    int i = 2, n, usados;
+    char conv;
+
+    if (argv[1] == NULL) {
+        fprintf(stderr, "printf: Error: falta el formato.\n");
+        ultimo_estado = 1;
+        return;
+    }
+    do {
+        usados = 0;
+        for (p = argv[1]; *p != '\0'; p++) {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+                switch (*p) {
+                case 'n': putchar('\n'); break;
+                case 't': putchar('\t'); break;
+                case 'r': putchar('\r'); break;
+                case 'a': putchar('\a'); break;
+                case 'v': putchar('\v'); break;
+                case 'f': putchar('\f'); break;
+                case '\\': putchar('\\'); break;
+                default: putchar('\\'); putchar(*p);
+                }
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+            n = strspn(p + 1, "-+ #0123456789.");  // Opciones, ancho y precisión, se pasan tal cual a la libc
+            conv = p[1 + n];
+            if (conv == '\0' || strchr("diouxXcsfeEgG", conv) == NULL || n > 20) {
+                fprintf(stderr, "printf: Error: conversión no válida en el formato.\n");
+                ultimo_estado = 1;
+                return;
+            }
+            arg = argv[i] != NULL ? argv[i++] : NULL;
+            usados++;
+            fin = NULL;
+            if (strchr("di", conv) != NULL) {
+                snprintf(spec, sizeof(spec), "%%%.*sll%c", n, p + 1, conv);
+                printf(spec, arg != NULL ? strtoll(arg, &fin, 0) : 0LL);
+            } else if (strchr("ouxX", conv) != NULL) {
+                snprintf(spec, sizeof(spec), "%%%.*sll%c", n, p + 1, conv);
+                printf(spec, arg != NULL ? strtoull(arg, &fin, 0) : 0ULL);
+            } else if (strchr("feEgG", conv) != NULL) {
+                snprintf(spec, sizeof(spec), "%%%.*s%c", n, p + 1, conv);
+                printf(spec, arg != NULL ? strtod(arg, &fin) : 0.0);
+            } else {  // %s y %c, el carácter como una cadena de uno para no escribir un \0 si no hay argumento
+                snprintf(spec, sizeof(spec), "%%%.*ss", n, p + 1);
+                if (conv == 'c') letra[0] = arg != NULL ? arg[0] : '\0';
+                printf(spec, conv == 'c' ? letra : (arg != NULL ? arg : ""));
+            }
+            if (fin != NULL && (*fin != '\0' || fin == arg)) {
+                fprintf(stderr, "printf: Error: %s no es un número.\n", arg);
+                ultimo_estado = 1;
+            }
+            p += 1 + n;
+        }
+    } while (usados > 0 && argv[i] != NULL);
+}
+
+void mandato_true(char **argv) {
+    (void)argv;
+}
+
+void mandato_false(char **argv) {
+    (void)argv;
+    ultimo_estado = 1;
+}
+
+// Implementación pwd
+void pwd(char **argv) {
+    char buf[4096];
+    (void)argv;
+    if (getcwd(buf, sizeof(buf)) == NULL) {
+        fprintf(stderr, "pwd: Error: %s\n", strerror(errno));
+        ultimo_estado = 1;
+        return;
+    }
+    printf("%s\n", buf);
+}
+
+// Implementación test y [, el status es 0 si la expresión es cierta, 1 si no y 2 si no es válida
+void test(char **argv) {
+    int n;
+    for (n = 0; argv[n] != NULL; n++);
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[n - 1], "]") != 0) {
+            fprintf(stderr, "[: Error: falta el ].\n");
+            ultimo_estado = 2;
+            return;
+        }
+        n--;
+    }
+    ultimo_estado = evaluar_test(argv + 1, n - 1);
+}
+
+// Expresiones de hasta tres palabras, como las de POSIX, con ! delante
+int evaluar_test(char **argv, int n) {
+    struct stat st;
+    long long a, b;
+    char *fin_a, *fin_b;
+    int r;
+    char op;
+
+    if (n == 0) return 1;
+    if (n == 3 && strcmp(argv[1], "=") == 0) return strcmp(argv[0], argv[2]) != 0;
+    if (n == 3 && strcmp(argv[1], "!=") == 0) return strcmp(argv[0], argv[2]) == 0;
+    if (n == 3 && argv[1][0] == '-' && strlen(argv[1]) == 3) {
+        a = strtoll(argv[0], &fin_a, 10);
+        b = strtoll(argv[2], &fin_b, 10);
+        if (*fin_a != '\0' || *fin_b != '\0' || fin_a == argv[0] || fin_b == argv[2]) {
+            fprintf(stderr, "test: Error: se esperaba un número.\n");
+            return 2;
+        }
+        if (strcmp(argv[1], "-eq") == 0) return !(a == b);
+        if (strcmp(argv[1], "-ne") == 0) return !(a != b);
+        if (strcmp(argv[1], "-lt") == 0) return !(a < b);
+        if (strcmp(argv[1], "-le") == 0) return !(a <= b);
+        if (strcmp(argv[1], "-gt") == 0) return !(a > b);
+        if (strcmp(argv[1], "-ge") == 0) return !(a >= b);
+    }
+    if (strcmp(argv[0], "!") == 0) {
+        r = evaluar_test(argv + 1, n - 1);
+        return r == 2 ? 2 : !r;
+    }
+    if (n == 1) return argv[0][0] == '\0';
+    if (n == 2 && argv[0][0] == '-' && argv[0][1] != '\0' && argv[0][2] == '\0') {
+        op = argv[0][1];
+        if (op == 'n') return argv[1][0] == '\0';
+        if (op == 'z') return argv[1][0] != '\0';
+        if (op == 'L') return lstat(argv[1], &st) != 0 || !S_ISLNK(st.st_mode);
+        if (strchr("efdsrwx", op) != NULL) {
+            if (stat(argv[1], &st) != 0) return 1;
+            switch (op) {
+            case 'e': return 0;
+            case 'f': return !S_ISREG(st.st_mode);
+            case 'd': return !S_ISDIR(st.st_mode);
+            case 's': return st.st_size == 0;
+            case 'r': return access(argv[1], R_OK) != 0;
+            case 'w': return access(argv[1], W_OK) != 0;
+            case 'x': return access(argv[1], X_OK) != 0;
+            }
+        }
+    }
+    fprintf(stderr, "test: Error: expresión no válida.\n");
+    return 2;
+}
+
+// Implementación exit
+void mandato_exit(char **argv) {
+    if (argv[1] != NULL) ultimo_estado = atoi(argv[1]);
+    salir();
+}
+
+void mandato_clear(char **argv) {
+    (void)argv;
+    if (system("clear") != 0) ultimo_estado = 1;
+}
+
+void salir() {
+    int i, j;
+    // Liberar memoria y matar los procesos en background, los de un subshell son copias de los de la minishell
+    for (i = 0; i < max_jobs && !subshell; i++) {
+        if (jobs_bg[i] == NULL) continue;
+        for (j = 0; j < jobs_bg[i]->nprocesos; j++)
+            if (jobs_bg[i]->pids[j] != -1 && jobs_bg[i]->estados[j] == -1) kill(jobs_bg[i]->pids[j], SIGKILL);
+        liberar_job(jobs_bg[i]);
+    }
+    free(jobs_bg);
+    free(ids_libres);
+    if (interactivo) {
+        system("clear");
+        printf("\033[0;31m------- Asesinando la minishell ---------\x1b[0m\n");
+        printf("\033[0;32m----------- Hasta la próxima ------------\x1b[0m\n");
+    }
+    if (!subshell) parar_traza();  // Que no se pierda lo que quede en el anillo
+    if (fd_sesion != -1 && !subshell) {  // El cliente de --serve termina con este status, después de toda la salida
+        fflush(NULL);
+        if (write(fd_sesion, &ultimo_estado, sizeof(ultimo_estado)) != sizeof(ultimo_estado)) exit(ultimo_estado);
+    }
+    // Salir con el status del último mandato, o el que se le haya dado a exit
+    exit(ultimo_estado);
+}
+
+// Implementación help
+void help(char **argv) {
+    (void)argv;
+    printf("\x1b[35m------- Minishell - Santiago Arias ------\n");
+    printf("\x1b[35m----------------- Ayuda -----------------\x1b[0m\n");
+    printf("Comandos internos:\n");
+    printf("cd [dir] - Cambia el directorio actual a dir. Sin especificar dir, se cambia al directorio HOME.\n");
+    printf("jobs [-l] - Muestra los procesos en segundo plano, con -l cada etapa con su pid, tiempo, CPU, memoria y cambios de contexto.\n");
+    printf("fg [n] - Pone el job n en primer plano, o el último job mandado a segundo plano si no se da un argumento.\n");
+    printf("umask [mask] - Cambia la máscara de permisos de los archivos creados por la minishell, o imprimir la actual.\n");
+    printf("exit [n] - Cierra la minishell, con status n o el del último mandato.\n");
+    printf("clear - Limpia la pantalla.\n");
+    printf("help - Muestra esta ayuda.\n");
+    printf("echo [-n] [arg...] - Escribe los argumentos separados por espacios, sin salto de línea final con -n.\n");
+    printf("printf formato [arg...] - Escribe los argumentos con el formato (%%s, %%d, %%i, %%u, %%x, %%o, %%c, %%f, %%e, %%g y %%%%), repitiéndolo mientras queden.\n");
+    printf("true, false - Terminan con status 0 y 1.\n");
+    printf("pwd - Muestra el directorio actual.\n");
+    printf("test expr, [ expr ] - Evalúa expr: -n/-z cadena, -e/-f/-d/-r/-w/-x/-s/-L fichero, = y != entre cadenas, -eq/-ne/-lt/-le/-gt/-ge entre números, y ! delante.\n");
+    printf("spawn [fork|posix_spawn] - Muestra o cambia cómo se crean los procesos hijos.\n");
+    printf("trace [fichero | off] - Muestra, empieza o para la traza de ejecución: una línea JSON por línea leída, pipe, redirección, proceso creado, exec, etapa terminada y job terminado. También con la variable MYSHELL_TRACE.\n");
+    printf("sched [--spread | --pack] [--cpus lista] [--nice n] [--ioprio n] | --off - Muestra o cambia en qué CPUs y con qué prioridad se ejecuta cada etapa de los pipelines. --pack las pone en CPUs seguidas, --spread lo más separadas posible. Mientras haya una política los mandatos se lanzan con fork, para ponerla antes del exec.\n");
+    printf("time mandato - Ejecuta el mandato y muestra su tiempo real y de CPU, por etapas si es un pipeline.\n");
+    printf("parallel [-j n] mandato [{}]... [::: arg...] - Ejecuta la línea una vez por argumento (los de detrás de ::: o uno por línea de la entrada), sustituyendo {} por él, con n jobs a la vez como mucho (por defecto, uno por CPU). La salida de cada job sale junta al terminar y el status es el número de jobs que fallan.\n");
+    printf("hash [-r] [mandato...] - Muestra la tabla de rutas de mandatos con sus aciertos y fallos, añade mandatos a ella o la vacía con -r (también la caché de directorios de los comodines).\n");
+    printf("history [n | -p prefijo | -s texto] - Muestra las n últimas líneas de la historia (todas sin n), las que empiezan por el prefijo o las que contienen el texto. La historia está en ~/.myshell_history y la comparten todas las sesiones.\n");
+    printf("export [VAR[=valor]...] - Exporta las variables, dándoles valor con =, o muestra las exportadas.\n");
+    printf("unset VAR... - Borra las variables.\n");
+    printf("Los mandatos internos valen en cualquier etapa de un pipeline.\n");
+    printf("$(mandato) se cambia por la salida del mandato, partida en argumentos por los espacios. mandato <<< palabra le da la palabra como entrada.\n");
+    printf("Variables: VAR=valor les da valor en la minishell (exportadas si ya lo estaban), y VAR=valor mandato solo para ese mandato (PATH=... mandato lo busca en ese PATH). $VAR, ${VAR} y $? (status del último mandato) se cambian por su valor en los argumentos y las redirecciones.\n");
+    printf("!! se cambia por la última línea de la historia, !n por la número n y !-n por la n-ésima empezando por el final. En un terminal, las flechas arriba y abajo recorren la historia y CTRL + R busca en ella hacia atrás.\n");
+    printf("Comodines: *, ?, [...] y ** (cualquier número de directorios, también ninguno: dir/** da dir/ y todo lo de debajo) en los argumentos se cambian por los caminos que casan, ordenados. Si no casa ninguno se dejan como están.\n");
+    printf("Redirecciones: < fichero, > fichero, >> fichero, 2> fichero, 2>> fichero, &> fichero (salida y error), &>> fichero, y 2>&1 en cualquier etapa para mandar el error a donde vaya su salida.\n");
+    printf("El resto de comandos se ejecutan como en cualquier shell UNIX.\n");
+    printf("Uso: myshell [-i] [-c mandato | script]. Con -c, un script o una entrada que no es un terminal no hay prompt y se devuelve el status del último mandato.\n");
+    printf("     myshell --serve socket. Ejecuta las líneas que le mandan los clientes (cliente socket [mandato...]) en una sesión por conexión.\n");
+}
+
+// Crear un proceso hijo que ejecute el mandato con entrada, salida y error redirigidos a los descriptores dados (-1 si no se tocan).
+// cerrar es un descriptor extra que el hijo no debe heredar abierto (el otro extremo del pipe), -1 si no hay
+pid_t lanzar(tcommand *mandato, int entrada, int salida, int error, int cerrar, tjob *job, int etapa) {
+    pid_t pid;
+    int err;
+    posix_spawn_file_actions_t acciones;
+    tinterno *interno = buscar_interno(mandato->argv[0]);
+    cpu_set_t *cpus = &job->cpus[etapa];
+    char **prefijos = prefijos_etapa(etapa), **envp;
+    int largo;
+
+    if (interno == NULL && mandato->filename == NULL) {  // El exec fallaría igual, así nos ahorramos crear el proceso con las dos formas
+        fprintf(stderr, "%s: No se encuentra el mandato.\n", mandato->argv[0]);
+        TRAZAR(EV_EXEC, -1, job, etapa, ENOENT, 0, mandato->argv[0]);
+        return -1;
+    }
+    // Los internos no tienen nada que ejecutar, necesitan fork. Con una política de sched también: posix_spawn no tiene atributos
+    // de afinidad ni de nice, y puestos al hijo ya creado llegarían después del exec
+    if (modo_lanzamiento == LANZAR_SPAWN && interno == NULL && !plan_activo()) {
+        // El umask lo hereda el hijo del proceso de la minishell, chumask ya lo deja puesto
+        posix_spawn_file_actions_init(&acciones);
+        if (entrada != -1) posix_spawn_file_actions_adddup2(&acciones, entrada, STDIN_FILENO);
+        if (salida != -1) posix_spawn_file_actions_adddup2(&acciones, salida, STDOUT_FILENO);
+        if (error != -1) posix_spawn_file_actions_adddup2(&acciones, error, STDERR_FILENO);
+        if (entrada > STDERR_FILENO) posix_spawn_file_actions_addclose(&acciones, entrada);
+        if (salida > STDERR_FILENO && salida != entrada) posix_spawn_file_actions_addclose(&acciones, salida);
+        if (error > STDERR_FILENO && error != salida && error != entrada) posix_spawn_file_actions_addclose(&acciones, error);
+        if (cerrar > STDERR_FILENO) posix_spawn_file_actions_addclose(&acciones, cerrar);
+        envp = entorno_mandato(prefijos);  // El de la minishell sin copiarlo, salvo con asignaciones delante del mandato
+        err = posix_spawn(&pid, mandato->filename, &acciones, &atributos_spawn, mandato->argv, envp);  // glibc usa clone(CLONE_VM | CLONE_VFORK), no copia las tablas de páginas
+        posix_spawn_file_actions_destroy(&acciones);
+        if (envp != envp_cache) free(envp);
+        if (err != 0) {
+            fprintf(stderr, "%s: Error al crear el proceso hijo, %s\n", mandato->argv[0], strerror(err));
+            TRAZAR(EV_EXEC, -1, job, etapa, err, 0, mandato->argv[0]);
+            return -1;
+        }
+        // posix_spawn vuelve después del exec del hijo, así que aquí ya se sabe que ha ido bien
+        TRAZAR(EV_FORK, pid, job, etapa, 0, 0, mandato->argv[0]);
+        TRAZAR(EV_EXEC, pid, job, etapa, 0, 0, mandato->argv[0]);
+        return pid;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "%s: Error al crear el proceso hijo, %s\n", mandato->argv[0], strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        traza = NULL;  // El anillo y el hilo que escribe son de la minishell, el hijo escribe directamente en el fichero
+        umask(umask_val);  // Cambiar la máscara de permisos
+        sigprocmask(SIG_SETMASK, &mascara_original, NULL);  // Desbloquear SIGCHLD, que solo lo bloquea la minishell
+        aplicar_plan(0, cpus);  // Afinidad, nice e ioprio de sched, antes del exec
+        if (entrada != -1 && dup2(entrada, STDIN_FILENO) < 0) {
+            fprintf(stderr, "%s: Error al leer del pipe, %s\n", mandato->argv[0], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (salida != -1 && dup2(salida, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "%s: Error al escribir en el pipe, %s\n", mandato->argv[0], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (error != -1) dup2(error, STDERR_FILENO);
+// Cerrar los extremos del pipe, dup2 duplica el descriptor de fichero, se puede cerrar el original, en este punto tenemos dos descriptores de fichero "iguales"
+        if (entrada > STDERR_FILENO) close(entrada);
+        if (salida > STDERR_FILENO && salida != entrada) close(salida);
+        if (error > STDERR_FILENO && error != salida && error != entrada) close(error);
+        if (cerrar > STDERR_FILENO) close(cerrar);
+        if (interno != NULL) {  // Subshell para un mandato interno: sin jobs, prompt ni avisos
+            subshell = 1;
+            interactivo = 0;
+            ultimo_estado = 0;
+            for (; prefijos != NULL && *prefijos != NULL; prefijos++) {  // En el subshell no hay que deshacerlas
+                largo = es_asignacion(*prefijos);
+                asignar_variable(*prefijos, largo, *prefijos + largo + 1, 1);
+            }
+            interno->funcion(mandato->argv);
+            fflush(stdout);
+            _exit(ultimo_estado);
+        }
+        execve(mandato->filename, mandato->argv, entorno_mandato(prefijos));
+        err = errno;
+        trazar_hijo(EV_EXEC, job, etapa, err, mandato->argv[0]);
+        fprintf(stderr, "%s: Error al crear el proceso hijo, %s\n", mandato->argv[0], strerror(err));  // Lo mismo que con posix_spawn
+        _exit(127);  // El status de las etapas que no se han podido lanzar
+    }
+    TRAZAR(EV_FORK, pid, job, etapa, 0, 0, mandato->argv[0]);
+    return pid;
+}
+
+// Ejecutar mandatos externos
+void ejecutar_externo(tline *linea) {
+    int status;
+    tjob *job;
+    ultimo_estado = 1;
+    job = lanzar_job(linea);
+    if (job == NULL) return;
+    if (job->vivos == 0) { // Ya ha terminado todo: etapas que no se han podido lanzar (127) o internos ejecutados en la minishell
+        status = job->estados[job->nprocesos - 1];
+        ultimo_estado = WEXITSTATUS(status);
+        liberar_job(job);
+        return;
+    }
+    if (linea->background) {
+        // Añadir el job a la tabla, ejecución en background
+        registrar_job(job);
+        ultimo_estado = 0;
+        if (interactivo) printf("[%d] %d\n", job->id, job->pids[0]);  // Lo mismo que hace una shell de UNIX cuando se manda un mandato a background
+        return;
+    }
+    // Ejecución en foreground, se espera a todas las etapas, así no queda ninguna zombie para el loop principal
+    esperar_job(job);
+    // Comprobar si el proceso hijo ha terminado correctamente
+    status = job->estados[job->nprocesos - 1];
+    ultimo_estado = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (linea->ncommands == 1 && WIFEXITED(status) != 0)
+        if (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 127) fprintf(stderr, "%s: Error al ejecutar el mandato.\n", linea->commands[0].argv[0]);  // Con 127 ya ha avisado el hijo
+    if (medir_tiempo) {
+        informe_job(job);
+        medir_tiempo = 0;
+    }
+    liberar_job(job);
+}
+
+// Abrir las redirecciones, crear los pipes y lanzar todas las etapas de la línea en un job, sin esperar a ninguna.
+// Devuelve NULL si no se ha podido lanzar nada por un error en las redirecciones o el pipe
+tjob *lanzar_job(tline *linea) {
+    int fd[2];
+    int salida, error;
+    tredirecciones redir;
+    tjob *job;
+
+    if (abrir_redirecciones(linea, &redir) == -1) return NULL;  // Si el fichero de redirección proporcionado es inválido, podemos salir directamente
+    resolver_mandatos(linea);  // Sustituir las rutas por las de la tabla hash
+    fflush(stdout);  // Que lo que haya escrito la minishell salga antes que lo de los hijos, y no lo copie fork
+    // Comprobar si necesitamos pipes
+    fd[0] = -1;
+    if (linea->ncommands > 1) {
+        if (pipe2(fd, O_CLOEXEC) != 0) {
+            fprintf(stderr, "%s: Error al crear el pipe, %s\n", linea->commands[0].argv[0], strerror(errno));
+            cerrar_redirecciones(&redir);
+            return NULL;
+        }
+    }
+
+    // Descriptores que tendrá el primer mandato, la salida y el error redirigidos solo si es también el último
+    if (linea->ncommands > 1) salida = fd[1];
+    else if (redir.salida != -1) salida = redir.salida;
+    else salida = salida_defecto;
+    error = (linea->ncommands == 1 && redir.error != -1) ? redir.error : error_defecto;
+
+    // Ejecutar en foreground o background lo haremos desde el padre, todas las etapas van al mismo job
+    job = nuevo_job(linea);
+    trazar_redirecciones(linea, job, &redir);
+    if (fd[0] != -1) TRAZAR(EV_PIPE, pid_minishell, job, 0, fd[0], fd[1], NULL);
+    lanzar_etapa(linea, job, 0, redir.entrada, salida, error, fd[0]);
+    // El hijo ya tiene su copia, la entrada no la usa nadie más
+    if (redir.entrada != -1) close(redir.entrada);
+    redir.entrada = -1;
+
+    // Proceso principal, en caso que haya pipes, mandamos la entrada de lectura del pipe, se produce después del execv
+    if (linea->ncommands > 1) {
+        // Todos los procesos tienen acceso independiente a los descriptores de fichero, luego también es necesario cerrar
+        // el extremo de escritura aquí para que el siguiente mandato sepa dónde termina la entrada estándar
+        close(fd[1]); // Cerramos este bicho aquí para que el hijo que creamos sepa dónde termina la entrada estándar
+        ejecutar_pipe(linea, linea->ncommands - 1, fd[0], job, &redir); // Solo nos hace falta enviar el extremo de lectura del pipe
+        close(fd[0]);
+    }
+    cerrar_redirecciones(&redir);  // Ya las tiene el último mandato
+    return job;
+}
+
+// Lanzar una etapa del job. Los mandatos internos que no escriben, o que escriben pero son la última etapa, se ejecutan en la propia
+// minishell y la etapa queda terminada sin pid (0). El resto, y todos los de un job en background, en un proceso hijo
+void lanzar_etapa(tline *linea, tjob *job, int etapa, int entrada, int salida, int error, int cerrar) {
+    tinterno *interno = buscar_interno(linea->commands[etapa].argv[0]);
+    int estado_anterior;
+
+    if (linea->error_to_output != NULL && linea->error_to_output[etapa]) error = STDOUT_FILENO;  // 2>&1, a la salida que tenga la etapa
+    clock_gettime(CLOCK_MONOTONIC, &job->lanzadas[etapa]);
+    if (interno != NULL && !job->background &&
+        (interno->tipo == INTERNO_PURO || (interno->tipo == INTERNO_SALIDA && etapa == linea->ncommands - 1))) {
+        estado_anterior = ultimo_estado;
+        ultimo_estado = 0;
+        ejecutar_en_proceso(interno, linea->commands[etapa].argv, salida, error, prefijos_etapa(etapa));
+        job->pids[etapa] = 0;
+        job->estados[etapa] = ultimo_estado << 8;  // Como el status de un hijo que sale con exit
+        clock_gettime(CLOCK_MONOTONIC, &job->terminadas[etapa]);
+        ultimo_estado = estado_anterior;
+        return;
+    }
+    cpus_etapa(job, etapa, &job->cpus[etapa]);
+    anadir_proceso(job, etapa, lanzar(&linea->commands[etapa], entrada, salida, error, cerrar, job, etapa));
+}
+
+void ejecutar_pipe(tline *linea, int restantes, int entrada, tjob *job, tredirecciones *redir) { // Una forma recursiva, relativamente elegante, de gestionar las líneas que tengan pipes
+    // int entrada representa lo que es nuestra entrada estándar para X mandato, luego es el equivalente a tener "fd[0]", tendremos que cerrarlo igualmente
+    int fd[2];
+    int salida, error;
+    tcommand *mandato = &linea->commands[linea->ncommands - restantes];
+
+    fd[0] = -1;
+    salida = salida_defecto;
+    error = error_defecto;
+    if (restantes != 1) {
+        if (pipe2(fd, O_CLOEXEC) != 0) {
+            fprintf(stderr, "%s: Error al crear el pipe: %s\n", mandato->argv[0], strerror(errno));
+            return;
+        }
+        salida = fd[1];  // Si no es el último mandato, seguiremos la recursión volviendo a redirigir la salida
+        TRAZAR(EV_PIPE, pid_minishell, job, linea->ncommands - restantes, fd[0], fd[1], NULL);
+    } else { // Si tenemos alguna redirección, se aplica aquí que es el último mandato de los enviados
+        // Las abrió lanzar_job en la minishell, para que valga cualquier forma de lanzar el proceso, y las cierra al volver
+        if (redir->salida != -1) salida = redir->salida;
+        if (redir->error != -1) error = redir->error;
+    }
+    lanzar_etapa(linea, job, linea->ncommands - restantes, entrada, salida, error, fd[0]);
+    // Si hubiera varios pipes, cargaríamos los mandatos de forma recursiva, enviando la salida de lectura de la tubería donde cargamos antes la salida estándar
+    if (restantes != 1) {
+        close(fd[1]);  // Cerramos la entrada de escritura aquí para que el siguiente hijo sepa dónde termina la entrada estándar, de forma análoga a la primera ejecución
+        ejecutar_pipe(linea, restantes - 1, fd[0], job, redir);  // Llamada recursiva, el último mandato no tomará esta rama
+        close(fd[0]);
+    }
+    // La espera de las etapas se hace en ejecutar_externo con el job completo
+}
+
+// Abrir todas las redirecciones de la línea. Si falla alguna, cierra las que ya había abierto y devuelve -1
+int abrir_redirecciones(tline *linea, tredirecciones *redir) {
+    redir->entrada = redir->salida = redir->error = -1;
+    if ((linea->redirect_input != NULL || linea->redirect_string != NULL) && (redir->entrada = abrir_entrada(linea)) == -1) return -1;
+    if (linea->redirect_output != NULL && (redir->salida = abrir_salida(linea, linea->redirect_output, linea->append_output)) == -1) {
+        cerrar_redirecciones(redir);
+        return -1;
+    }
+    if (linea->redirect_error != NULL && (redir->error = abrir_salida(linea, linea->redirect_error, linea->append_error)) == -1) {
+        cerrar_redirecciones(redir);
+        return -1;
+    }
+    return 0;
+}
+
+// Entrada del primer mandato, < fichero o <<< palabra. -1 si no se puede abrir
+int abrir_entrada(tline *linea) {
+    int fd;
+    if (linea->redirect_input != NULL) fd = open(linea->redirect_input, O_RDONLY | O_CLOEXEC);
+    else fd = entrada_cadena(linea->redirect_string);
+    if (fd == -1) {
+        fprintf(stderr, "%s: Error. No se pudo abrir %s, %s\n", linea->commands[0].argv[0],
+                linea->redirect_input != NULL ? linea->redirect_input : "el here-string", strerror(errno));
+    }
+    return fd;
+}
+
+// Fichero de una redirección de salida o error, con el umask de la minishell, vaciándolo (>) o añadiendo al final (>>)
+int abrir_salida(tline *linea, char *fichero, int anadir) {
+    int fd = open(fichero, O_WRONLY | O_CREAT | O_CLOEXEC | (anadir ? O_APPEND : O_TRUNC), 0666 & ~umask_val);
+    if (fd == -1) fprintf(stderr, "%s: Error. No se pudo abrir o crear %s, %s\n", linea->commands[0].argv[0], fichero, strerror(errno));
+    return fd;
+}
+
+// Cerrar lo que abrió abrir_redirecciones, cuando ya lo tiene el último mandato que lo necesita
+void cerrar_redirecciones(tredirecciones *redir) {
+    if (redir->entrada != -1) close(redir->entrada);
+    if (redir->salida != -1) close(redir->salida);
+    if (redir->error != -1) close(redir->error);
+    redir->entrada = redir->salida = redir->error = -1;
+}
+
+void trazar_redirecciones(tline *linea, tjob *job, tredirecciones *redir) {
+    if (traza == NULL) return;
+    if (redir->entrada != -1)
+        trazar(EV_REDIR, pid_minishell, job, 0, redir->entrada, STDIN_FILENO, linea->redirect_input != NULL ? linea->redirect_input : "<<<");
+    if (redir->salida != -1) trazar(EV_REDIR, pid_minishell, job, linea->ncommands - 1, redir->salida, STDOUT_FILENO, linea->redirect_output);
+    if (redir->error != -1) trazar(EV_REDIR, pid_minishell, job, linea->ncommands - 1, redir->error, STDERR_FILENO, linea->redirect_error);
+}
+
+// Descriptor del que se lee la cadena de un here-string con un salto de línea detrás, sin pasar por disco. Si cabe en el buffer de un pipe
+// se escribe entera y se cierra el otro extremo, así nadie tiene que ir escribiendo mientras el mandato lee. Si no (el write no bloquea
+// y se queda corto), en un memfd
+int entrada_cadena(char *cadena) {
+    struct iovec iov[2] = { { cadena, strlen(cadena) }, { "\n", 1 } };
+    size_t total = iov[0].iov_len + 1;
+    ssize_t escritos;
+    int fd[2];
+
+    if (total <= 65536 && pipe2(fd, O_CLOEXEC) == 0) {
+        fcntl(fd[1], F_SETFL, O_NONBLOCK);
+        escritos = writev(fd[1], iov, 2);
+        close(fd[1]);
+        if (escritos == (ssize_t)total) return fd[0];
+        close(fd[0]);
+    }
+    fd[0] = memfd_create("here-string", MFD_CLOEXEC);
+    if (fd[0] == -1) return -1;
+    while (iov[0].iov_len > 0) {
+        escritos = write(fd[0], iov[0].iov_base, iov[0].iov_len);
+        if (escritos == -1 && errno == EINTR) continue;
+        if (escritos == -1) break;
+        iov[0].iov_base = (char *)iov[0].iov_base + escritos;
+        iov[0].iov_len -= escritos;
+    }
+    if (iov[0].iov_len > 0 || write(fd[0], "\n", 1) != 1 || lseek(fd[0], 0, SEEK_SET) == -1) {
+        close(fd[0]);
+        return -1;
     }
-    return redir;
+    return fd[0];
 }
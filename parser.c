@@ -0,0 +1,394 @@
+/* Parser de la minishell, sustituye a libparser.a manteniendo tline y tcommand.
+ * Los tokens se cortan sobre la propia línea (se escriben '\0' en ella) y todo lo demás
+ * sale de una arena que se reinicia por línea, así que no hay malloc por token ni estado global. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "parser.h"
+
+#define TAM_BLOQUE 4096
+
+/* Símbolos de más de un carácter */
+#define HERE_STRING 'h'		/* "<<<" */
+#define APPEND 'a'		/* ">>" */
+#define ERROR 'e'		/* "2>" */
+#define ERROR_APPEND 'E'	/* "2>>" */
+#define ERROR_TO_OUTPUT '1'	/* "2>&1", sin fichero detrás y en cualquier mandato del pipeline */
+#define BOTH 'b'		/* "&>" */
+#define BOTH_APPEND 'B'		/* "&>>" */
+
+typedef struct {
+	char * s;		/* Palabra, NULL si es un símbolo */
+	char simbolo;		/* '<', '>', '|', '&' o uno de los de arriba, 0 si es una palabra */
+} ttoken;
+
+void *
+arena_alloc(tarena *arena, size_t tam) {
+	tbloque * b;
+	void * p;
+
+	tam = (tam + 7) & ~(size_t)7;
+	/* Buscar sitio en el bloque actual o en los siguientes, que quedan de líneas anteriores */
+	for (b = arena->actual; b != NULL; b = b->sig) {
+		if (b->tam - b->usado >= tam) {
+			p = b->datos + b->usado;
+			b->usado += tam;
+			arena->actual = b;
+			return p;
+		}
+		if (b->sig != NULL) b->sig->usado = 0;
+	}
+	b = malloc(sizeof(tbloque) + (tam > TAM_BLOQUE ? tam : TAM_BLOQUE));
+	if (b == NULL) {
+		perror("Fatal Error");
+		exit(1);
+	}
+	b->tam = tam > TAM_BLOQUE ? tam : TAM_BLOQUE;
+	b->usado = tam;
+	b->sig = NULL;
+	if (arena->actual != NULL) {
+		/* Se engancha detrás del actual, los bloques que hubiera después no tenían sitio */
+		b->sig = arena->actual->sig;
+		arena->actual->sig = b;
+	} else {
+		arena->primero = b;
+	}
+	arena->actual = b;
+	return b->datos;
+}
+
+char *
+arena_strdup(tarena *arena, const char *s) {
+	size_t n = strlen(s) + 1;
+	return memcpy(arena_alloc(arena, n), s, n);
+}
+
+void
+arena_reset(tarena *arena) {
+	if (arena->primero == NULL) return;
+	arena->primero->usado = 0;
+	arena->actual = arena->primero;
+}
+
+void
+arena_liberar(tarena *arena) {
+	tbloque * b, * sig;
+	for (b = arena->primero; b != NULL; b = sig) {
+		sig = b->sig;
+		free(b);
+	}
+	arena->primero = NULL;
+	arena->actual = NULL;
+}
+
+static int
+issymbol(char c) {
+	return c == '<' || c == '>' || c == '|' || c == '&';
+}
+
+/* Caracteres del símbolo que empieza en p (0 si no empieza ninguno), que se deja en simbolo. "2>" solo es
+ * la redirección del error al principio de una palabra (inicio), como en sh; detrás de otros caracteres es un argumento */
+static int
+symbol(const char *p, int inicio, char *simbolo) {
+	*simbolo = *p;
+	switch (p[0]) {
+	case '2':
+		if (!inicio || p[1] != '>') return 0;
+		if (p[2] == '&' && p[3] == '1') {
+			*simbolo = ERROR_TO_OUTPUT;
+			return 4;
+		}
+		*simbolo = p[2] == '>' ? ERROR_APPEND : ERROR;
+		return p[2] == '>' ? 3 : 2;
+	case '<':
+		if (p[1] != '<' || p[2] != '<') return 1;
+		*simbolo = HERE_STRING;
+		return 3;
+	case '>':
+		if (p[1] != '>') return 1;
+		*simbolo = APPEND;
+		return 2;
+	case '&':
+		if (p[1] != '>') return 1;
+		*simbolo = p[2] == '>' ? BOTH_APPEND : BOTH;
+		return p[2] == '>' ? 3 : 2;
+	case '|':
+		return 1;
+	}
+	return 0;
+}
+
+/* Fin de la palabra que empieza en p. Un "$(...)" va entero en la palabra, con sus espacios, símbolos y paréntesis
+ * anidados. Si no se cierra llega hasta el final de la línea, y el error lo da quien lo sustituye */
+static char *
+word_end(char *p) {
+	int nivel = 0;
+
+	for (; *p; p++) {
+		if (p[0] == '$' && p[1] == '(') {
+			nivel++;
+			p++;
+		} else if (nivel > 0) {
+			if (*p == '(') nivel++;
+			else if (*p == ')') nivel--;
+		} else if (issymbol(*p) || isspace((unsigned char)*p)) {
+			break;
+		}
+	}
+	return p;
+}
+
+/* Partir la línea en tokens: palabras sin espacios ni símbolos, y cada símbolo suelto.
+ * Con tokens a NULL solo cuenta */
+static int
+fill_tokens(char *str, ttoken *tokens) {
+	int n = 0, len;
+	char * p = str;
+	char * inicio;
+	char c;
+
+	while (*p) {
+		while (isspace((unsigned char)*p)) p++;
+		if (*p == '\0') break;
+		if ((len = symbol(p, 1, &c)) > 0) {
+			if (tokens != NULL) {
+				tokens[n].s = NULL;
+				tokens[n].simbolo = c;
+			}
+			n++;
+			p += len;
+			continue;
+		}
+		inicio = p;
+		p = word_end(p);
+		if (tokens != NULL) {
+			tokens[n].s = inicio;
+			tokens[n].simbolo = 0;
+			/* El carácter que corta la palabra se pierde, si era un símbolo se guarda antes como token */
+			if ((len = symbol(p, 0, &c)) > 0) {
+				tokens[n + 1].s = NULL;
+				tokens[n + 1].simbolo = c;
+				n++;
+				*p = '\0';
+				p += len;
+			} else if (*p) {
+				*p++ = '\0';
+			}
+		}
+		n++;
+	}
+	return n;
+}
+
+/* Mismas reglas que libparser.a */
+static int
+check_syntax(ttoken *tokens, int n) {
+	int in = 0, out = 0, err = 0, bg = 0, pipe = 0, err_out = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		switch (tokens[i].simbolo) {
+		case '<':
+		case HERE_STRING:	/* Los dos son la entrada del primer mandato, solo puede haber uno */
+			if (in || pipe || i == 0 || i == n - 1 || tokens[i + 1].simbolo) return 0;
+			in = 1;
+			break;
+		case '>':
+			if (i + 1 < n && tokens[i + 1].simbolo == '&') {
+				/* ">& fichero", libparser.a no comprobaba que hubiera fichero detrás */
+				if (err || err_out || i == 0 || i + 2 >= n || tokens[i + 2].simbolo) return 0;
+				err = 1;
+				i++;
+			} else {
+				if (out || i == 0 || i == n - 1 || tokens[i + 1].simbolo) return 0;
+				out = 1;
+			}
+			break;
+		case APPEND:
+			if (out || i == 0 || i == n - 1 || tokens[i + 1].simbolo) return 0;
+			out = 1;
+			break;
+		case ERROR:
+		case ERROR_APPEND:
+			if (err || err_out || i == 0 || i == n - 1 || tokens[i + 1].simbolo) return 0;
+			err = 1;
+			break;
+		case ERROR_TO_OUTPUT:	/* Solo uno por mandato, y no junto a otra redirección del error */
+			if (err || err_out || i == 0) return 0;
+			err_out = 1;
+			break;
+		case BOTH:
+		case BOTH_APPEND:
+			if (out || err || err_out || i == 0 || i == n - 1 || tokens[i + 1].simbolo) return 0;
+			out = err_out = 1;
+			break;
+		case '&':
+			if (bg) return 0;
+			bg = 1;
+			break;
+		case '|':
+			if (out || err || i == 0 || i == n - 1 || tokens[i + 1].simbolo) return 0;
+			pipe = 1;
+			err_out = 0;
+			break;
+		}
+	}
+	return 1;
+}
+
+tline *
+tokenize_r(char *str, tarena *arena) {
+	tline * line;
+	ttoken * tokens;
+	tcommand * cmd;
+	int ntokens, i, j, c;
+
+	line = arena_alloc(arena, sizeof(tline));
+	memset(line, 0, sizeof(tline));
+
+	/* Dos pasadas, una para contar y otra para cortar, así los arrays se reservan una vez */
+	ntokens = fill_tokens(str, NULL);
+	tokens = arena_alloc(arena, (ntokens + 1) * sizeof(ttoken));
+	fill_tokens(str, tokens);
+	if (!check_syntax(tokens, ntokens)) {
+		fprintf(stderr, "Syntax error checking.\n");
+		return NULL;
+	}
+
+	/* Contar mandatos y argumentos de cada uno */
+	j = 0;
+	for (i = 0; i < ntokens; i++) {
+		if (tokens[i].simbolo == '|') line->ncommands++;
+		if (tokens[i].simbolo == '&' && (i == 0 || tokens[i - 1].simbolo != '>')) line->background = 1;
+		if (tokens[i].simbolo == 0) j++;
+	}
+	if (j == 0) {
+		/* Sin palabras solo puede quedar un "&" suelto */
+		line->ncommands = 0;
+		return line;
+	}
+	line->ncommands++;
+	line->commands = arena_alloc(arena, line->ncommands * sizeof(tcommand));
+	memset(line->commands, 0, line->ncommands * sizeof(tcommand));
+	for (i = 0, c = 0; i < ntokens; i++) {
+		switch (tokens[i].simbolo) {
+		case 0:
+			line->commands[c].argc++;
+			break;
+		case '|':
+			c++;
+			break;
+		case '&':
+		case ERROR_TO_OUTPUT:
+			break;
+		case '>':
+			if (tokens[i + 1].simbolo == '&') i++;
+			/* fall through */
+		default:
+			i++;	/* El fichero de la redirección no es un argumento */
+		}
+	}
+	for (c = 0; c < line->ncommands; c++) {
+		if (line->commands[c].argc == 0) {
+			/* Como "& | ls", libparser.a lo daba por bueno y fallaba al buscar el mandato */
+			fprintf(stderr, "Syntax error checking.\n");
+			return NULL;
+		}
+		line->commands[c].argv = arena_alloc(arena, (line->commands[c].argc + 1) * sizeof(char *));
+		line->commands[c].argv[0] = NULL;
+	}
+
+	/* Rellenar */
+	cmd = line->commands;
+	j = 0;
+	for (i = 0; i < ntokens; i++) {
+		switch (tokens[i].simbolo) {
+		case 0:
+			cmd->argv[j++] = tokens[i].s;
+			cmd->argv[j] = NULL;
+			break;
+		case '|':
+			cmd++;
+			j = 0;
+			break;
+		case '<':
+			line->redirect_input = tokens[++i].s;
+			break;
+		case HERE_STRING:
+			line->redirect_string = tokens[++i].s;
+			break;
+		case '>':
+			if (tokens[i + 1].simbolo == '&') {
+				line->redirect_error = tokens[i + 2].s;
+				i += 2;
+			} else {
+				line->redirect_output = tokens[++i].s;
+			}
+			break;
+		case APPEND:
+			line->redirect_output = tokens[++i].s;
+			line->append_output = 1;
+			break;
+		case ERROR_APPEND:
+			line->append_error = 1;
+			/* fall through */
+		case ERROR:
+			line->redirect_error = tokens[++i].s;
+			break;
+		case BOTH_APPEND:
+			line->append_output = 1;
+			/* fall through */
+		case BOTH:
+			line->redirect_output = tokens[++i].s;
+			/* fall through */
+		case ERROR_TO_OUTPUT:
+			if (line->error_to_output == NULL) {
+				line->error_to_output = arena_alloc(arena, line->ncommands * sizeof(int));
+				memset(line->error_to_output, 0, line->ncommands * sizeof(int));
+			}
+			line->error_to_output[cmd - line->commands] = 1;
+			break;
+		}
+	}
+	return line;
+}
+
+/* La misma búsqueda que hacía libparser.a, solo la usa tokenize */
+static char *
+cmd2path(tarena *arena, char *cmd) {
+	char buf[1024];
+	char * path;
+	size_t n;
+
+	if (strchr(cmd, '/') != NULL) {
+		return access(cmd, X_OK) == 0 ? cmd : NULL;
+	}
+	path = getenv("PATH");
+	if (path == NULL) path = "/bin:/usr/bin";
+	while (1) {
+		n = strcspn(path, ":");
+		snprintf(buf, sizeof(buf), "%.*s/%s", (int)n, path, cmd);
+		if (access(buf, X_OK) == 0) return arena_strdup(arena, buf);
+		if (path[n] == '\0') return NULL;
+		path += n + 1;
+	}
+}
+
+tline *
+tokenize(char *str) {
+	static tarena arena;
+	tline * line;
+	int i;
+
+	arena_reset(&arena);
+	line = tokenize_r(str, &arena);
+	if (line == NULL) return NULL;
+	for (i = 0; i < line->ncommands; i++) {
+		line->commands[i].filename = cmd2path(&arena, line->commands[i].argv[0]);
+	}
+	return line;
+}
@@ -1,3 +1,4 @@
+#include <stddef.h>
 
 typedef struct {
 	char * filename;
@@ -12,7 +13,34 @@ typedef struct {
 	char * redirect_output;
 	char * redirect_error;
 	int background;
+	/* Al final, libparser.a no los tiene */
+	char * redirect_string;	/* Palabra de "<<<", la entrada del primer mandato */
+	int append_output;	/* ">>" o "&>>": redirect_output se abre para añadir */
+	int append_error;	/* "2>>" */
+	int * error_to_output;	/* Por mandato, "2>&1" (o "&>" en el último): el error va a donde vaya su salida. NULL si no hay ninguno */
 } tline;
 
+/* Arena de memoria por línea: todo lo que reserva el parser sale de aquí y se libera de golpe con arena_reset */
+typedef struct tbloque {
+	struct tbloque * sig;
+	size_t tam;
+	size_t usado;
+	char datos[];
+} tbloque;
+
+typedef struct {
+	tbloque * primero;
+	tbloque * actual;
+} tarena;
+
+/* Reentrante: no usa estado global. Los tokens apuntan dentro de str, que se modifica,
+ * y el tline vale hasta el siguiente arena_reset. filename queda a NULL, lo resuelve quien llama */
+extern tline * tokenize_r(char *str, tarena *arena);
+
+/* Compatible con el libparser.a original: arena propia que se reinicia en cada llamada y filename resuelto con PATH */
 extern tline * tokenize(char *str);
 
+extern void * arena_alloc(tarena *arena, size_t tam);
+extern char * arena_strdup(tarena *arena, const char *s);
+extern void arena_reset(tarena *arena);
+extern void arena_liberar(tarena *arena);